@@ -197,7 +197,16 @@ void CopyLoadSegments(Elf64_Ehdr* ehdr) {
   }
 }
 
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
+// the kernel maps pages of the volume image into apps, so the image must start on a page boundary
+EFI_STATUS AllocatePageBuffer(UINTN size, VOID** buffer) {
+  EFI_PHYSICAL_ADDRESS addr;
+  EFI_STATUS status = gBS->AllocatePages(
+      AllocateAnyPages, EfiLoaderData, (size + 0xfff) / 0x1000, &addr);
+  *buffer = (VOID*)addr;
+  return status;
+}
+
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer, BOOLEAN page_aligned) {
   EFI_STATUS status;
 
   UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
@@ -212,7 +221,11 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL* file, VOID** buffer) {
   EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
   UINTN file_size = file_info->FileSize;
 
-  status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
+  if(page_aligned) {
+    status = AllocatePageBuffer(file_size, buffer);
+  } else {
+    status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
+  }
   if(EFI_ERROR(status)) {
     return status;
   }
@@ -258,7 +271,7 @@ EFI_STATUS ReadBlocks(
     ) {
 
   EFI_STATUS status;
-  status = gBS->AllocatePool(EfiLoaderData, read_bytes, buffer);
+  status = AllocatePageBuffer(read_bytes, buffer);
   if(EFI_ERROR(status)) {
     return status;
   }
@@ -343,7 +356,7 @@ EFI_STATUS EFIAPI UefiMain(
   }
 
   VOID* kernel_buffer;
-  status = ReadFile(kernel_file, &kernel_buffer);
+  status = ReadFile(kernel_file, &kernel_buffer, FALSE);
   if(EFI_ERROR(status)) {
     Print(L"error: %r\n", status);
     Halt();
@@ -377,7 +390,7 @@ EFI_STATUS EFIAPI UefiMain(
       EFI_FILE_MODE_READ, 0
       );
   if(status == EFI_SUCCESS) {
-    status = ReadFile(volume_file, &volume_image);
+    status = ReadFile(volume_file, &volume_image, TRUE);
     if(EFI_ERROR(status)) {
       Print(L"failed to read volume file: %r", status);
       Halt();
@@ -93,14 +93,14 @@ extern "C" void main(int argc, char** argv) {
     }
     SyscallWinRedraw(layer_id);
 
-    static unsigned long prev_timeout = 0;
-    if (prev_timeout == 0) {
-      const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-      prev_timeout = timeout.value;
-    } else {
-      prev_timeout += 1000 / kFrameRate;
-      SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+    // frame n is at start + n / kFrameRate seconds, which doesn't drift by rounding
+    static uint64_t start = 0;
+    static uint64_t frame = 0;
+    if (start == 0) {
+      start = SyscallGetCurrentTimeNs().value;
     }
+    ++frame;
+    SyscallCreateTimerNs(TIMER_ONESHOT_ABS, 1, start + frame * 1000000000 / kFrameRate);
 
     // #@@range_begin(read_event)
     AppEvent events[1];
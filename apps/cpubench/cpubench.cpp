@@ -0,0 +1,33 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+/* counts primes below n by trial division, touching no memory but the stack */
+unsigned long CountPrimes(unsigned long n) {
+  unsigned long count = 0;
+  for(unsigned long i = 2; i < n; i++) {
+    bool prime = true;
+    for(unsigned long d = 2; d * d <= i; d++) {
+      if(i % d == 0) {
+        prime = false;
+        break;
+      }
+    }
+    count += prime;
+  }
+  return count;
+}
+
+/* usage: cpubench [n]. a CPU bound load for smpbench */
+extern "C" void main(int argc, char** argv) {
+  unsigned long n = 2000000;
+  if(argc >= 2) {
+    n = strtoul(argv[1], nullptr, 0);
+  }
+
+  auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+  const auto count = CountPrimes(n);
+  auto tick_end = SyscallGetCurrentTick();
+  printf("%lu primes below %lu in %lu ms\n", count, n, (tick_end.value - tick_start) * 1000 / timer_freq);
+  exit(0);
+}
@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "../syscall.h"
+
+/* copies a file through a private mapping of the source and a shared mapping of the destination */
+extern "C" void main(int argc, char** argv) {
+  if(argc < 3) {
+    printf("Usage: %s <src> <dest>\n", argv[0]);
+    exit(1);
+  }
+
+  SyscallResult res = SyscallOpenFile(argv[1], O_RDONLY);
+  if(res.error) {
+    printf("failed to open for read: %s\n", argv[1]);
+    exit(1);
+  }
+  size_t src_size;
+  res = SyscallMapFile(res.value, &src_size, 0);
+  if(res.error) {
+    printf("failed to map %s: %d\n", argv[1], res.error);
+    exit(1);
+  }
+  const char* src = reinterpret_cast<const char*>(res.value);
+
+  res = SyscallOpenFile(argv[2], O_CREAT | O_WRONLY);
+  if(res.error) {
+    printf("failed to open for write: %s\n", argv[2]);
+    exit(1);
+  }
+  size_t dest_size = src_size;
+  res = SyscallMapFile(res.value, &dest_size, MAP_FILE_SHARED);
+  if(res.error) {
+    printf("failed to map %s: %d\n", argv[2], res.error);
+    exit(1);
+  }
+  char* dest = reinterpret_cast<char*>(res.value);
+
+  memcpy(dest, src, src_size);
+  res = SyscallSyncMapping(res.value, src_size);
+  if(res.error) {
+    printf("failed to sync %s: %d\n", argv[2], res.error);
+    exit(1);
+  }
+  printf("copied %lu bytes, %lu dirty pages written back\n", src_size, res.value);
+  exit(0);
+}
@@ -50,6 +50,15 @@ caddr_t sbrk(int incr) {
     dpage_end = res.value + 4096 * num_pages;
   }
 
+  /* give the pages above the new break back. they are demand paged again when the break grows */
+  if(incr < 0) {
+    const uint64_t unused_begin = (program_break + incr + 4095) & ~(uint64_t)4095;
+    const uint64_t unused_end = (program_break + 4095) & ~(uint64_t)4095;
+    if(unused_begin < unused_end) {
+      SyscallUnmapPages(unused_begin, (unused_end - unused_begin) / 4096);
+    }
+  }
+
   const uint64_t prev_break = program_break;
   program_break += incr;
   return (caddr_t)prev_break;
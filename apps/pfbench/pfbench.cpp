@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include "../syscall.h"
+
+struct TouchResult {
+  unsigned long ms;
+  unsigned long faults;
+};
+
+/* touches pages linearly, once to fault them in and once more after they are mapped */
+TouchResult TouchPages(volatile char* buf, size_t bytes) {
+  auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+  const auto faults_start = SyscallGetPageFaults().value;
+  for(size_t off = 0; off < bytes; off += 4096) {
+    buf[off] += 1;
+  }
+  const auto faults_end = SyscallGetPageFaults().value;
+  auto tick_end = SyscallGetCurrentTick();
+  return { (tick_end.value - tick_start) * 1000 / timer_freq, faults_end - faults_start };
+}
+
+/* usage: pfbench [MiB] touches demand pages, pfbench /path touches a mapped file */
+extern "C" void main(int argc, char** argv) {
+  volatile char* buf;
+  size_t bytes;
+  if(argc >= 2 && argv[1][0] == '/') {
+    SyscallResult res = SyscallOpenFile(argv[1], O_RDONLY);
+    if(res.error) {
+      printf("failed to open %s: %d\n", argv[1], res.error);
+      exit(1);
+    }
+    const int fd = res.value;
+    res = SyscallMapFile(fd, &bytes, 0);
+    if(res.error) {
+      printf("failed to map %s: %d\n", argv[1], res.error);
+      exit(1);
+    }
+    buf = reinterpret_cast<volatile char*>(res.value);
+  } else {
+    size_t mib = 64;
+    if(argc >= 2) {
+      mib = atoi(argv[1]);
+    }
+    bytes = mib * 1024 * 1024;
+
+    auto [addr, err] = SyscallDemandPages(bytes / 4096, 0);
+    if(err) {
+      printf("failed to demand pages: %d\n", err);
+      exit(1);
+    }
+    buf = reinterpret_cast<volatile char*>(addr);
+  }
+
+  const auto first = TouchPages(buf, bytes);
+  const auto second = TouchPages(buf, bytes);
+  printf("%lu KiB (%lu pages): first touch %lu ms %lu faults, mapped %lu ms %lu faults\n",
+      bytes / 1024, (bytes + 4095) / 4096, first.ms, first.faults, second.ms, second.faults);
+  exit(0);
+}
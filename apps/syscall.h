@@ -18,6 +18,7 @@ struct SyscallResult {
 
 #define LAYER_NO_REDRAW (0x00000001ull << 32)
 #define TIMER_ONESHOT_REL 1
+#define MAP_FILE_SHARED 1 /* writable, and written back to the file by SyscallSyncMapping, unmapping and exit */
 #define TIMER_ONESHOT_ABS 0
 
 struct SyscallResult SyscallLogString(enum LogLevel level, const char* message);
@@ -36,6 +37,12 @@ struct SyscallResult SyscallOpenFile(const char* path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
+struct SyscallResult SyscallGetPageFaults();
+struct SyscallResult SyscallUnmapPages(uint64_t addr, size_t num_pages);
+struct SyscallResult SyscallSyncMapping(uint64_t addr, size_t len);
+/* monotonic nanoseconds, and a timer of them whose event reports the deadline as the timeout */
+struct SyscallResult SyscallGetCurrentTimeNs();
+struct SyscallResult SyscallCreateTimerNs(unsigned int type, int timer_value, uint64_t timeout_ns);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+/* upper bounds of the latency buckets in microseconds. the last one is for the rest */
+const uint64_t kBucketBounds[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+const int kNumBuckets = sizeof(kBucketBounds) / sizeof(kBucketBounds[0]) + 1;
+
+/* usage: timerjitter [count] [period_us]
+ * sets count timers one after another at every period, and shows how late they are received.
+ * the kernel programs the LAPIC timer in the TSC-deadline mode if it can,
+ * and in the one-shot mode if booted with "lapic_timer=oneshot" */
+extern "C" void main(int argc, char** argv) {
+  const unsigned long count = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 1000;
+  const unsigned long period_us = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 1000;
+  if(count == 0 || period_us == 0) {
+    printf("Usage: timerjitter [count] [period_us]\n");
+    exit(1);
+  }
+
+  unsigned long buckets[kNumBuckets] = {};
+  uint64_t min_ns = UINT64_MAX, max_ns = 0, total_ns = 0;
+  const uint64_t start = SyscallGetCurrentTimeNs().value;
+  for(unsigned long i = 1; i <= count; i++) {
+    SyscallCreateTimerNs(TIMER_ONESHOT_ABS, 1, start + i * period_us * 1000);
+
+    AppEvent event;
+    do {
+      SyscallReadEvent(&event, 1);
+      if(event.type == AppEvent::kQuit) {
+        exit(1);
+      }
+    } while(event.type != AppEvent::kTimerTimeout);
+
+    const uint64_t now = SyscallGetCurrentTimeNs().value;
+    const uint64_t latency = now - event.arg.timer.timeout;
+    min_ns = latency < min_ns ? latency : min_ns;
+    max_ns = latency > max_ns ? latency : max_ns;
+    total_ns += latency;
+
+    int b = 0;
+    while(b < kNumBuckets - 1 && latency >= kBucketBounds[b] * 1000) {
+      b++;
+    }
+    buckets[b]++;
+  }
+
+  printf("%lu timers every %lu us: latency min %lu, avg %lu, max %lu us\n",
+      count, period_us, min_ns / 1000, total_ns / count / 1000, max_ns / 1000);
+  for(int b = 0; b < kNumBuckets; b++) {
+    if(buckets[b] == 0) {
+      continue;
+    }
+    if(b < kNumBuckets - 1) {
+      printf("  < %5lu us: %6lu ", kBucketBounds[b], buckets[b]);
+    } else {
+      printf(" >= %5lu us: %6lu ", kBucketBounds[b - 1], buckets[b]);
+    }
+    for(unsigned long n = 0; n < buckets[b] * 50 / count; n++) {
+      printf("#");
+    }
+    printf("\n");
+  }
+  exit(0);
+}
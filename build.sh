@@ -11,5 +11,6 @@ done
 
 if [ "${1:-}" = "run" ]
 then
-  MIKANOS_DIR=$PWD $HOME/osbook/devenv/run_mikanos.sh
+  # four CPUs unless QEMU_OPTS says otherwise, so that the SMP paths are exercised
+  QEMU_OPTS="${QEMU_OPTS:--smp 4}" MIKANOS_DIR=$PWD $HOME/osbook/devenv/run_mikanos.sh
 fi
@@ -70,7 +70,32 @@ namespace acpi {
     return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
   }
 
+  size_t MADT::ProcessorLAPICIDs(uint32_t* ids, size_t max_ids) const {
+    const uint8_t kTypeLocalAPIC = 0;
+    size_t n = 0;
+    auto p = reinterpret_cast<const uint8_t*>(this + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(this) + this->header.length;
+    while(p + 2 <= end && p[1] >= 2 && n < max_ids) {
+      /* type, length, ACPI processor ID, APIC ID, and 4 bytes of flags whose bit 0 is enabled */
+      if(p[0] == kTypeLocalAPIC && p[1] >= 8 && (p[4] & 1)) {
+        ids[n++] = p[3];
+      }
+      p += p[1];
+    }
+    return n;
+  }
+
   const FADT* fadt;
+  const MADT* madt;
+
+  uint32_t ReadPMTimer() {
+    return IoIn32(fadt->pm_tmr_blk);
+  }
+
+  uint32_t PMTimerMask() {
+    const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+    return pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+  }
 
   void WaitMilliseconds(unsigned long msec) {
     const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -99,11 +124,13 @@ namespace acpi {
     }
 
     fadt = nullptr;
+    madt = nullptr;
     for(int i = 0; i < xsdt.Count(); i++) {
       const auto& entry = xsdt[i];
-      if(entry.IsValid("FACP")) {
+      if(fadt == nullptr && entry.IsValid("FACP")) {
         fadt = reinterpret_cast<const FADT*>(&entry);
-        break;
+      } else if(madt == nullptr && entry.IsValid("APIC")) {
+        madt = reinterpret_cast<const MADT*>(&entry);
       }
     }
 
@@ -48,9 +48,23 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+/* Multiple APIC Description Table, followed by entries of interrupt controllers */
+struct MADT {
+  DescriptionHeader header;
+  uint32_t lapic_address;
+  uint32_t flags;
+
+  /* LAPIC IDs of the enabled processors, up to max_ids of them. returns the number found */
+  size_t ProcessorLAPICIDs(uint32_t* ids, size_t max_ids) const;
+} __attribute__((packed));
+
 extern const FADT* fadt;
+extern const MADT* madt;
 const int kPMTimerFreq = 3579545;
 
+/* the PM timer counts up at kPMTimerFreq and wraps around at PMTimerMask() */
+uint32_t ReadPMTimer();
+uint32_t PMTimerMask();
 void WaitMilliseconds(unsigned long msec);
 void Initialize(const RSDP& rsdp);
 }
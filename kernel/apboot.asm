@@ -0,0 +1,79 @@
+; apboot.asm
+;
+; Startup code of application processors. StartApplicationProcessors copies it to
+; kAPBootAddress below 1 MiB, and an AP woken by a SIPI starts at its top in real mode.
+; It enters long mode with the page map of the BSP and calls the entry with the CPU.
+
+%define AP_BOOT_ADDRESS 0x8000
+%define ADDR(label) (AP_BOOT_ADDRESS + (label) - APBootStart)
+
+bits 16
+section .text
+
+global APBootStart
+APBootStart:
+    cli
+    xor ax, ax
+    mov ds, ax
+    lgdt [ADDR(ap_gdtr)]
+    mov eax, cr0
+    or eax, 1 ; PE
+    mov cr0, eax
+    jmp dword 0x08:ADDR(.protected_mode)
+
+bits 32
+.protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; CR4 of the BSP but PCIDE, which can be set only in long mode
+    mov eax, [ADDR(APBootParams.cr4)]
+    and eax, ~(1 << 17)
+    mov cr4, eax
+    mov eax, [ADDR(APBootParams.cr3)]
+    mov cr3, eax
+    mov ecx, 0xc0000080 ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8 ; LME
+    wrmsr
+    ; enables paging, and so long mode
+    mov eax, [ADDR(APBootParams.cr0)]
+    mov cr0, eax
+    jmp 0x18:ADDR(.long_mode)
+
+bits 64
+.long_mode:
+    mov rax, [ADDR(APBootParams.cr4)]
+    mov cr4, rax
+    mov rsp, [ADDR(APBootParams.stack)]
+    mov rdi, [ADDR(APBootParams.cpu)]
+    mov rax, [ADDR(APBootParams.entry)]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff ; 32 bit code
+    dq 0x00cf92000000ffff ; 32 bit data
+    dq 0x00af9a000000ffff ; 64 bit code
+ap_gdtr:
+    dw ap_gdtr - ap_gdt - 1
+    dd ADDR(ap_gdt)
+
+align 8
+global APBootParams ; filled by StartApplicationProcessors, see struct APBootParams
+APBootParams:
+.cr3:   dq 0
+.cr4:   dq 0
+.cr0:   dq 0
+.stack: dq 0
+.entry: dq 0
+.cpu:   dq 0
+
+global APBootEnd
+APBootEnd:
@@ -0,0 +1,68 @@
+#include "app_cache.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+/* a node of std::list is an image and two links */
+SlabCache AppImageCache::image_cache_{"appimage", sizeof(AppImageCache::Image) + 2 * sizeof(void*)};
+
+const AppLoadInfo* AppImageCache::Find(const fat::DirectoryEntry& entry) {
+  for(auto it = images_.begin(); it != images_.end(); ++it) {
+    if(it->first_cluster != entry.FirstCluster()) {
+      continue;
+    }
+    if(it->size != entry.file_size || it->stamp != fat::WriteStamp(entry)) {
+      Evict(it);
+      break;
+    }
+    images_.splice(images_.begin(), images_, it);
+    hits_++;
+    return &images_.front().info;
+  }
+  misses_++;
+  return nullptr;
+}
+
+bool AppImageCache::Contains(const fat::DirectoryEntry& entry) const {
+  for(const auto& image : images_) {
+    if(image.first_cluster == entry.FirstCluster() && image.size == entry.file_size &&
+        image.stamp == fat::WriteStamp(entry)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AppImageCache::Insert(const fat::DirectoryEntry& entry, const AppLoadInfo& info,
+    size_t num_pages) {
+  while(!images_.empty() && pinned_pages_ + num_pages > kMaxPinnedPages) {
+    Evict(std::prev(images_.end()));
+  }
+  images_.push_front({entry.FirstCluster(), entry.file_size, fat::WriteStamp(entry), info, num_pages});
+  pinned_pages_ += num_pages;
+}
+
+size_t AppImageCache::Reclaim(size_t num_frames) {
+  const auto allocated = memory_manager->Stat().allocated_frames;
+  /* the most recently launched image may be being copied right now */
+  while(images_.size() > 1 && allocated - memory_manager->Stat().allocated_frames < num_frames) {
+    Evict(std::prev(images_.end()));
+  }
+  return allocated - memory_manager->Stat().allocated_frames;
+}
+
+void AppImageCache::Evict(ImageList::iterator it) {
+  if(auto err = FreeAppPageMap(it->info.pml4)) {
+    Log(kError, "failed to free an app image: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+  }
+  pinned_pages_ -= it->num_pages;
+  images_.erase(it);
+}
+
+AppImageCache* app_image_cache;
+
+void InitializeAppImageCache() {
+  app_image_cache = new AppImageCache;
+  memory_manager->AddReclaimer([](size_t num_frames) {
+    return app_image_cache->Reclaim(num_frames);
+  });
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include "fat.hpp"
+#include "paging.hpp"
+#include "slab.hpp"
+
+struct AppLoadInfo {
+  uint64_t vaddr_end, entry;
+  PageMapEntry* pml4;
+};
+
+/* Page maps of eagerly loaded apps, kept to be copied on the next launch.
+ * An image is keyed by the first cluster, size and write stamp of its file, so a rewritten file misses.
+ * The least recently launched images are freed when too many pages are pinned or memory runs short.
+ * Reclaim may run inside malloc when the kernel heap grows, so the images are kept in a slab cache.
+ */
+class AppImageCache {
+  public:
+    static const size_t kMaxPinnedPages = 16384; /* 64 MiB */
+
+    /* the image of the file, or nullptr. a stale image of the file is freed on the way */
+    const AppLoadInfo* Find(const fat::DirectoryEntry& entry);
+    /* same as Find but leaves the statistics and the LRU order alone */
+    bool Contains(const fat::DirectoryEntry& entry) const;
+    /* takes over info.pml4, which must not be loaded in CR3 any more */
+    void Insert(const fat::DirectoryEntry& entry, const AppLoadInfo& info, size_t num_pages);
+    /* frees images from the least recently launched one until num_frames frames are freed */
+    size_t Reclaim(size_t num_frames);
+
+    size_t Images() const { return images_.size(); }
+    size_t PinnedPages() const { return pinned_pages_; }
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+  private:
+    struct Image {
+      uint32_t first_cluster, size, stamp;
+      AppLoadInfo info;
+      size_t num_pages;
+    };
+
+    using ImageList = std::list<Image, SlabAllocator<Image>>;
+    static SlabCache image_cache_;
+
+    ImageList images_{SlabAllocator<Image>{image_cache_}}; /* the most recently launched first */
+    size_t pinned_pages_{0}, hits_{0}, misses_{0};
+
+    void Evict(ImageList::iterator it);
+};
+
+extern AppImageCache* app_image_cache;
+void InitializeAppImageCache();
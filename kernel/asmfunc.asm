@@ -86,6 +86,16 @@ SetCR3:
     mov cr3, rdi
     ret
 
+global GetCR4
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4
+SetCR4:
+    mov cr4, rdi
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -108,7 +118,7 @@ GetCR3:
   ret
 
 global SwitchContext
-SwitchContext: ;void SwitchContext(void* next_ctx, void* current_ctx)
+SwitchContext: ;void SwitchContext(void* next_ctx, void* current_ctx, void* saved_flag)
   mov [rsi + 0x40], rax
   mov [rsi + 0x48], rbx
   mov [rsi + 0x50], rcx
@@ -147,6 +157,11 @@ SwitchContext: ;void SwitchContext(void* next_ctx, void* current_ctx)
 
   fxsave [rsi + 0xc0]
 
+  ; the context is saved, so another CPU may resume it from now on
+  mov rax, [rsi + 0x58] ; saved_flag
+  mov byte [rax], 0
+
+
 global RestoreContext
 RestoreContext:
   ; iret stack
@@ -159,11 +174,11 @@ RestoreContext:
   fxrstor [rdi + 0xc0]
 
   mov rax, [rdi + 0x00]
+  or rax, [gs:8] ; CPU::cr3_flags keeps TLB entries tagged with the PCID
   mov cr3, rax
   mov rax, [rdi + 0x30]
   mov fs, ax
-  mov rax, [rdi + 0x38]
-  mov gs, ax
+  ; GS is not restored, since its base points at the per-CPU data
 
   mov rax, [rdi + 0x40]
   mov rbx, [rdi + 0x48]
@@ -278,6 +293,8 @@ WriteMSR: ; void WriteMSR(uint32_t msr, uint64_t value) RDI, RSI;
   ret
 
 extern GetCurrentTaskOSStackPointer
+extern EnterKernel
+extern LeaveKernel
 extern syscall_table
 global SyscallEntry
 SyscallEntry: ; void SyscallEntry(void);
@@ -307,7 +324,35 @@ SyscallEntry: ; void SyscallEntry(void);
   pop rax
   and rsp, 0xfffffffffffffff0
 
+  ; take the kernel lock, keeping the arguments
+  push rax
+  push rdi
+  push rsi
+  push rdx
+  push rcx
+  push r8
+  push r9
+  sub rsp, 8
+  call EnterKernel
+  add rsp, 8
+  pop r9
+  pop r8
+  pop rcx
+  pop rdx
+  pop rsi
+  pop rdi
+  pop rax
+
   call [syscall_table + 8 * eax]
+
+  cmp dword [rbp], 0x80000002
+  je .locked ; the terminal goes on in the kernel after Exit
+  push rax
+  push rdx
+  call LeaveKernel
+  pop rdx
+  pop rax
+.locked:
   mov rsp, rbp
 
   pop rsi ; resotre system call number
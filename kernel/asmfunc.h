@@ -14,7 +14,10 @@ extern "C" {
   uint64_t GetCR0();
   uint64_t GetCR2();
   uint64_t GetCR3();
-  void SwitchContext(void* next_ctx, void* current_ctx);
+  uint64_t GetCR4();
+  void SetCR4(uint64_t value);
+  /* saved_flag is a byte cleared once current_ctx is saved */
+  void SwitchContext(void* next_ctx, void* current_ctx, void* saved_flag);
   void RestoreContext(void* ctx);
   int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
   void IntHandlerLAPICTimer();
@@ -0,0 +1,69 @@
+#include "boot_option.hpp"
+#include <array>
+#include <cctype>
+#include <cstring>
+#include "fat.hpp"
+#include "logger.hpp"
+
+namespace {
+  struct BootOption {
+    const char* key;
+    const char* value;
+  };
+
+  /* this module works before the kernel heap is ready, so no dynamic allocation here */
+  char option_buf[1024];
+  std::array<BootOption, 16> options;
+  int num_options = 0;
+
+  char* Trim(char* s) {
+    while(isspace(*s)) s++;
+    char* end = s + strlen(s);
+    while(end > s && isspace(end[-1])) end--;
+    *end = '\0';
+    return s;
+  }
+}
+
+void InitializeBootOption() {
+  auto [ entry, post_slash ] = fat::FindFile("/kernel.cfg");
+  if(entry == nullptr || entry->attr == fat::Attribute::kDirectory) {
+    return;
+  }
+
+  const size_t len = fat::LoadFile(option_buf, sizeof(option_buf) - 1, *entry);
+  option_buf[len] = '\0';
+
+  char* line = option_buf;
+  while(line && num_options < options.size()) {
+    char* next_line = strchr(line, '\n');
+    if(next_line) {
+      *next_line = '\0';
+      next_line++;
+    }
+
+    char* eq = strchr(line, '=');
+    if(line[0] != '#' && eq) {
+      *eq = '\0';
+      options[num_options].key = Trim(line);
+      options[num_options].value = Trim(&eq[1]);
+      Log(kInfo, "boot option: %s=%s\n", options[num_options].key, options[num_options].value);
+      num_options++;
+    }
+    line = next_line;
+  }
+}
+
+const char* GetBootOption(const char* key) {
+  for(int i = 0; i < num_options; i++) {
+    if(strcmp(options[i].key, key) == 0) {
+      return options[i].value;
+    }
+  }
+  return nullptr;
+}
+
+bool BootOptionIs(const char* key, const char* value) {
+  const char* v = GetBootOption(key);
+  return v != nullptr && strcmp(v, value) == 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+/* Boot options are read from "/kernel.cfg" on the boot volume.
+ * Each line is "key=value". Lines starting with '#' are ignored.
+ * fat::Initialize must be called before InitializeBootOption.
+ */
+void InitializeBootOption();
+const char* GetBootOption(const char* key);
+bool BootOptionIs(const char* key, const char* value);
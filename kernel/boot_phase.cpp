@@ -0,0 +1,65 @@
+#include "boot_phase.hpp"
+
+#include <array>
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  struct BootPhase {
+    const char* name;
+    uint64_t start_tsc, end_tsc;
+  };
+
+  const size_t kMaxBootPhases = 32;
+  std::array<BootPhase, kMaxBootPhases> phases;
+  size_t num_phases = 0;
+  uint64_t boot_start_tsc, phase_start_tsc;
+
+  uint64_t TSCToMicroseconds(uint64_t tsc) {
+    const uint64_t freq = TSCFrequency();
+    return freq == 0 ? 0 : tsc * 1000000 / freq;
+  }
+
+  /* calls print(name, us) for each phase, and then for the rest and the total */
+  template <class F>
+  void ForEachBootPhase(F print) {
+    uint64_t in_phases = 0, end = boot_start_tsc;
+    for(size_t i = 0; i < num_phases; i++) {
+      const uint64_t tsc = phases[i].end_tsc - phases[i].start_tsc;
+      print(phases[i].name, TSCToMicroseconds(tsc));
+      in_phases += tsc;
+      end = phases[i].end_tsc;
+    }
+    print("other", TSCToMicroseconds(end - boot_start_tsc - in_phases));
+    print("total", TSCToMicroseconds(end - boot_start_tsc));
+  }
+}
+
+void StartBootPhases() {
+  boot_start_tsc = __builtin_ia32_rdtsc();
+  num_phases = 0;
+}
+
+void BeginBootPhase() {
+  phase_start_tsc = __builtin_ia32_rdtsc();
+}
+
+void EndBootPhase(const char* name) {
+  if(num_phases == kMaxBootPhases) {
+    return;
+  }
+  phases[num_phases++] = {name, phase_start_tsc, __builtin_ia32_rdtsc()};
+}
+
+void LogBootPhases() {
+  /* at kWarn, which the kernel logs at by default, so that every boot reports it */
+  ForEachBootPhase([](const char* name, uint64_t us) {
+    Log(kWarn, "boot: %8lu us %s\n", us, name);
+  });
+}
+
+void PrintBootPhases(FileDescriptor& fd) {
+  ForEachBootPhase([&fd](const char* name, uint64_t us) {
+    PrintToFD(fd, "%8lu us %s\n", us, name);
+  });
+}
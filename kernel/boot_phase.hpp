@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "file.hpp"
+
+/* Boot phases are timed by the TSC, which counts from before any timer is set up.
+ * The boot is timed from StartBootPhases, and the time out of any phase is reported as "other".
+ */
+void StartBootPhases();
+void BeginBootPhase();
+void EndBootPhase(const char* name);
+
+/* runs the call as a boot phase named after it */
+#define BOOT_PHASE(call) do { BeginBootPhase(); call; EndBootPhase(#call); } while(0)
+
+/* the time of each phase in microseconds. InitializeLAPICTimer must be called before them */
+void LogBootPhases();
+void PrintBootPhases(FileDescriptor& fd);
@@ -1,10 +1,12 @@
 #include "fat.hpp"
 #include <cstring>
 #include <cctype>
+#include <map>
 #include <utility>
 #include <stack>
 #include <string>
 #include "logger.hpp"
+#include "page_cache.hpp"
 
 namespace {
 std::pair<const char*, bool> NextPathElement(const char* path, char* path_elem) {
@@ -20,6 +22,8 @@ std::pair<const char*, bool> NextPathElement(const char* path, char* path_elem)
   return {&next_slash[1], true};
 }
 
+/* first cluster -> write stamp of the files written since boot. made on the first write */
+std::map<uint32_t, uint32_t>* write_stamps;
 }
 
 namespace fat {
@@ -59,6 +63,21 @@ namespace fat {
     }
   }
 
+  uint32_t WriteStamp(const DirectoryEntry& entry) {
+    if(write_stamps == nullptr) {
+      return 0;
+    }
+    auto it = write_stamps->find(entry.FirstCluster());
+    return it == write_stamps->end() ? 0 : it->second;
+  }
+
+  void BumpWriteStamp(const DirectoryEntry& entry) {
+    if(write_stamps == nullptr) {
+      write_stamps = new std::map<uint32_t, uint32_t>;
+    }
+    (*write_stamps)[entry.FirstCluster()]++;
+  }
+
   unsigned long NextCluster(unsigned long cluster) {
     uintptr_t fat_offset = 
       boot_volume_image->reserved_sector_count * boot_volume_image->bytes_per_sector;
@@ -405,6 +424,10 @@ namespace fat {
       }
     }
 
+    /* cached pages of the file would go stale */
+    page_cache->Drop(CacheID(), wr_off_, len);
+    BumpWriteStamp(fat_entry_);
+
     const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
     
     size_t total = 0;
@@ -436,15 +459,82 @@ namespace fat {
     FileDescriptor fd{fat_entry_};
     fd.rd_off_ = offset;
 
-    unsigned long cluster = fat_entry_.FirstCluster();
-    while(offset >= bytes_per_cluster) {
-      offset -= bytes_per_cluster;
-      cluster = NextCluster(cluster);
+    Seek(offset, false);
+    fd.rd_cluster_ = seek_cluster_;
+    fd.rd_cluster_off_ = offset - seek_off_;
+    return fd.Read(buf, len);
+  }
+
+  void* FileDescriptor::PageAddress(size_t offset) {
+    const size_t kPageSize = 4096;
+    /* the rest of the last page holds whatever follows the file in the volume */
+    if(offset + kPageSize > fat_entry_.file_size) {
+      return nullptr;
     }
 
-    fd.rd_cluster_ = cluster;
-    fd.rd_cluster_off_ = offset;
-    return fd.Read(buf, len);
+    Seek(offset, false);
+    const uintptr_t page = GetClusterAddr(seek_cluster_) + (offset - seek_off_);
+    if(page % kPageSize != 0) {
+      return nullptr;
+    }
+
+    /* the clusters covering the page must be consecutive */
+    unsigned long cluster = seek_cluster_;
+    for(size_t off = seek_off_ + bytes_per_cluster; off < offset + kPageSize; off += bytes_per_cluster) {
+      const auto next_cluster = NextCluster(cluster);
+      if(next_cluster != cluster + 1) {
+        return nullptr;
+      }
+      cluster = next_cluster;
+    }
+    return reinterpret_cast<void*>(page);
+  }
+
+  size_t FileDescriptor::Store(const void* buf, size_t len, size_t offset) {
+    if(len == 0) {
+      return 0;
+    }
+    if(fat_entry_.FirstCluster() == 0) {
+      const auto cluster = AllocateClusterChain(1);
+      memset(GetSectorByCluster<uint8_t>(cluster), 0, bytes_per_cluster);
+      fat_entry_.first_cluster_low = cluster & 0xffff;
+      fat_entry_.first_cluster_high = (cluster >> 16) & 0xffff;
+    }
+
+    /* cached pages of the file would go stale */
+    page_cache->Drop(CacheID(), offset, len);
+    BumpWriteStamp(fat_entry_);
+
+    const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+    size_t total = 0;
+    while(total < len) {
+      Seek(offset + total, true);
+      const size_t cluster_off = offset + total - seek_off_;
+      const size_t n = std::min(len - total, bytes_per_cluster - cluster_off);
+      memcpy(GetSectorByCluster<uint8_t>(seek_cluster_) + cluster_off, &buf8[total], n);
+      total += n;
+    }
+
+    fat_entry_.file_size = std::max<size_t>(fat_entry_.file_size, offset + len);
+    return total;
+  }
+
+  /* sets seek_cluster_ to the cluster containing offset, extending the chain with zeroed clusters if extend is set.
+   * sequential calls continue from the last cluster instead of walking the chain from the first one */
+  void FileDescriptor::Seek(size_t offset, bool extend) {
+    if(seek_cluster_ == 0 || offset < seek_off_) {
+      seek_cluster_ = fat_entry_.FirstCluster();
+      seek_off_ = 0;
+    }
+    while(offset - seek_off_ >= bytes_per_cluster) {
+      auto next_cluster = NextCluster(seek_cluster_);
+      if(extend && IsEndOfClusterchain(next_cluster)) {
+        next_cluster = ExtendCluster(seek_cluster_, 1);
+        memset(GetSectorByCluster<uint8_t>(next_cluster), 0, bytes_per_cluster);
+      }
+      seek_off_ += bytes_per_cluster;
+      seek_cluster_ = next_cluster;
+    }
   }
 
   unsigned long AllocateClusterChain(size_t n) {
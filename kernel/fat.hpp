@@ -79,6 +79,11 @@ namespace fat {
 
   void ReadName(const DirectoryEntry& entry, char* base, char* ext);
 
+  /* how many times the file has been written since boot, kept in memory by its first cluster.
+   * the app image cache uses it to tell a rewritten file */
+  uint32_t WriteStamp(const DirectoryEntry& entry);
+  void BumpWriteStamp(const DirectoryEntry& entry);
+
   static const unsigned long kEndOfClusterchain = 0x0ffffffflu;
   unsigned long NextCluster(unsigned long cluster);
 
@@ -108,6 +113,9 @@ namespace fat {
       size_t Write(const void* buf, size_t len) override;
       size_t Size() const override { return fat_entry_.file_size; }
       size_t Load(void* buf, size_t len, size_t offset) override;
+      size_t Store(const void* buf, size_t len, size_t offset) override;
+      void* PageAddress(size_t offset) override;
+      uint64_t CacheID() const override { return fat_entry_.FirstCluster(); }
     private:
       DirectoryEntry& fat_entry_;
       size_t rd_off_ = 0;
@@ -116,5 +124,10 @@ namespace fat {
       size_t wr_off_ = 0;
       unsigned long wr_cluster_ = 0;
       size_t wr_cluster_off_ = 0;
+      /* the cluster Seek stopped at and its offset in the file */
+      unsigned long seek_cluster_ = 0;
+      size_t seek_off_ = 0;
+
+      void Seek(size_t offset, bool extend);
   };
 }
@@ -1,6 +1,23 @@
 #include "file.hpp"
 #include <cstdio>
 
+SlabCache file_cache{"file", 128};
+
+void* FileDescriptor::operator new(size_t size) {
+  if(size <= file_cache.ObjectSize()) {
+    return file_cache.Allocate();
+  }
+  return ::operator new(size);
+}
+
+void FileDescriptor::operator delete(void* p, size_t size) noexcept {
+  if(size <= file_cache.ObjectSize()) {
+    file_cache.Free(p);
+    return;
+  }
+  ::operator delete(p);
+}
+
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...) {
   va_list ap;
   int result;
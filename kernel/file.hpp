@@ -1,6 +1,9 @@
 #pragma once
 #include "error.hpp"
+#include "slab.hpp"
 #include <cstddef>
+#include <memory>
+#include <utility>
 
 class FileDescriptor {
   public:
@@ -9,7 +12,26 @@ class FileDescriptor {
     virtual size_t Write(const void* buf, size_t len) = 0;
     virtual size_t Size() const = 0;
     virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+    /* writes at offset, extending the file if needed. files which can't be written at an offset store nothing */
+    virtual size_t Store(const void* buf, size_t len, size_t offset) { return 0; }
+    /* the page aligned address where the 4 KiB of the file at offset are stored contiguously,
+     * or nullptr. such a page can be mapped into apps without copying it */
+    virtual void* PageAddress(size_t offset) { return nullptr; }
+    /* identifies the file in the page cache. 0 means the file is not cached */
+    virtual uint64_t CacheID() const { return 0; }
+
+    /* descriptors larger than the file cache object size fall back to the heap */
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size) noexcept;
 };
 
+extern SlabCache file_cache;
+
+/* allocates the descriptor and its shared_ptr control block in one file cache object */
+template <class T, class... Args>
+std::shared_ptr<T> MakeFileDescriptor(Args&&... args) {
+  return std::allocate_shared<T>(SlabAllocator<T>{file_cache}, std::forward<Args>(args)...);
+}
+
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
 size_t ReadDelim(FileDescriptor& fd, char delim, char* buf, size_t len);
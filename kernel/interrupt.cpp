@@ -7,6 +7,7 @@
 #include "font.hpp"
 #include "graphics.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -27,6 +28,7 @@ namespace {
 
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
+    InterruptHandlerScope scope;
     task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
     NotifyEndOfInterrupt();
   }
@@ -55,10 +57,26 @@ namespace {
     PrintHex(frame->rsp, 16, {500 + 8*12, 16*3});
   }
 
+  __attribute__((interrupt))
+  void IntHandlerTLBShootdown(InterruptFrame* frame) {
+    InterruptHandlerScope scope;
+    CPURelax();
+    NotifyEndOfInterrupt();
+  }
+
+  /* does nothing but stop hlt of the idle task, which then finds a task to run */
+  __attribute__((interrupt))
+  void IntHandlerWakeup(InterruptFrame* frame) {
+    InterruptHandlerScope scope;
+    NotifyEndOfInterrupt();
+  }
+
   void KillApp(InterruptFrame *frame) {
     const auto cpl = frame->cs & 0x3;
     if(cpl != 3) return;
 
+    /* the app is over, and the terminal goes on in the kernel */
+    EnterKernel();
     auto& task = task_manager->CurrentTask();
     __asm__("sti");
     ExitApp(task.OSStackPointer(), 128 + SIGSEGV);
@@ -67,7 +85,12 @@ namespace {
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
     uint64_t cr2 = GetCR2();
+    /* faults in the kernel occur with the lock held */
+    const bool entered = EnterKernel();
     if(auto err = HandlePageFault(error_code, cr2); !err) {
+      if(entered) {
+        LeaveKernel();
+      }
       return;
     }
 
@@ -124,6 +147,8 @@ void InitializeInterrupt() {
   };
 
   set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+  set_idt_entry(InterruptVector::kTLBShootdown, IntHandlerTLBShootdown);
+  set_idt_entry(InterruptVector::kWakeup, IntHandlerWakeup);
   SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */, true /* present */, kISForTimer /* IST */), reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kKernelCS
       );
 
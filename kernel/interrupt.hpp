@@ -50,6 +50,8 @@ class InterruptVector {
     enum Number {
       kXHCI = 0x40,
       kLAPICTimer = 0x41,
+      kTLBShootdown = 0x42,
+      kWakeup = 0x43,
     };
 };
 
@@ -63,6 +65,29 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+/* disables interrupts while alive, and then restores the interrupt flag as it was.
+ * usable both in tasks and in interrupt handlers.
+ * host-side tools define MIKANOS_HOST, since cli faults in user mode */
+class InterruptGuard {
+  public:
+#ifndef MIKANOS_HOST
+    InterruptGuard() {
+      __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags_) : : "memory");
+    }
+    ~InterruptGuard() {
+      if(rflags_ & (1u << 9)) {
+        __asm__ volatile("sti" : : : "memory");
+      }
+    }
+#else
+    InterruptGuard() : rflags_{0} {}
+#endif
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+  private:
+    uint64_t rflags_;
+};
+
 void InitializeInterrupt();
 
 const int kISForTimer = 1; // index of the interrupt stack table
@@ -12,11 +12,21 @@ namespace {
     auto it = std::remove_if(c.begin(), c.end(), pred);
     c.erase(it, c.end());
   }
+
+  SlabCache layer_cache{"layer", sizeof(Layer)};
 }
 
 Layer::Layer(unsigned int id): id_{id} {
 }
 
+void* Layer::operator new(size_t size) {
+  return layer_cache.Allocate();
+}
+
+void Layer::operator delete(void* p) noexcept {
+  layer_cache.Free(p);
+}
+
 unsigned int Layer::ID() const {
   return id_;
 }
@@ -213,6 +223,7 @@ namespace {
 LayerManager* layer_manager;
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+SpinLock layer_lock;
 
 void InitializeLayer() {
   const auto screen_size = ScreenSize();
@@ -302,12 +313,11 @@ Error CloseLayer(unsigned int layer_id) {
     const auto pos = layer->GetPosition();
     const auto size = layer->GetWindow()->Size();
 
-    __asm__("cli");
+    SpinLockGuard guard{layer_lock};
     active_layer->Activate(0);
     layer_manager->RemoveLayer(layer_id);
     layer_manager->Draw({pos, size});
     layer_task_map->erase(layer_id);
-    __asm__("sti");
 
     return MAKE_ERROR(Error::kSuccess);
 }
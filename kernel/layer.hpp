@@ -2,12 +2,17 @@
 #include "window.hpp"
 #include "frame_buffer.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "spinlock.hpp"
 #include <map>
 
 class Layer {
   public:
     Layer(unsigned int id = 0);
     unsigned int ID() const;
+    /* layers are allocated from a slab cache */
+    static void* operator new(size_t size);
+    static void operator delete(void* p) noexcept;
 
     Layer& SetWindow(const std::shared_ptr<Window>& window);
     std::shared_ptr<Window> GetWindow() const;
@@ -74,6 +79,8 @@ class ActiveLayer {
 
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+/* held while layers are added, removed or activated, and layer_task_map is updated */
+extern SpinLock layer_lock;
 
 constexpr Message MakeLayerMessage(
     uint64_t task_id, unsigned int layer_id, LayerOperation op, const Rectangle<int>& area
@@ -6,6 +6,7 @@
 #include <deque>
 #include <limits>
 #include <array>
+#include <optional>
 
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
@@ -32,6 +33,10 @@
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "boot_option.hpp"
+#include "page_cache.hpp"
+#include "smp.hpp"
+#include "boot_phase.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -136,56 +141,61 @@ alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_ref, const MemoryMap& memory_map_ref, 
     const acpi::RSDP& acpi_table, void* volume_image) {
 
+  StartBootPhases();
   MemoryMap memory_map{memory_map_ref};
 
-  InitializeGraphics(frame_buffer_config_ref);
-  InitializeConsole();
+  BOOT_PHASE(InitializeGraphics(frame_buffer_config_ref));
+  BOOT_PHASE(InitializeConsole());
 
   printk("Welcome to Mikan OS!\n");
   SetLogLevel(kWarn);
 
-  InitializeSegmentation();
-  InitializePaging();
-  InitializeMemoryManager(memory_map);
-  InitializeTSS();
-  InitializeInterrupt();
-
-  fat::Initialize(volume_image);
-  InitializeFont();
-  InitializePCI();
-
-  InitializeLayer();
-  InitializeMainWindow();
-  InitializeTextWindow();
+  BOOT_PHASE(InitializeSegmentation());
+  BOOT_PHASE(InitializePaging(memory_map));
+  BOOT_PHASE(fat::Initialize(volume_image));
+  BOOT_PHASE(InitializeBootOption());
+  BOOT_PHASE(InitializeMemoryManager(memory_map));
+  BOOT_PHASE(InitializePageCache());
+  BOOT_PHASE(InitializeTSS());
+  BOOT_PHASE(InitializeInterrupt());
+  BOOT_PHASE(InitializeBootCPU());
+
+  BOOT_PHASE(InitializeFont());
+  BOOT_PHASE(InitializePCI());
+
+  BOOT_PHASE(InitializeLayer());
+  BOOT_PHASE(InitializeMainWindow());
+  BOOT_PHASE(InitializeTextWindow());
   layer_manager->Draw({{0, 0}, ScreenSize()});
 
-  acpi::Initialize(acpi_table);
-  InitializeLAPICTimer();
+  BOOT_PHASE(acpi::Initialize(acpi_table));
+  BOOT_PHASE(InitializeLAPICTimer());
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1});
+  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1}.Repeat(kTimer05Sec));
   bool textbox_cursor_visible = false;
 
-  InitializeSyscall();
-  InitializeTask();
+  BOOT_PHASE(InitializeSyscall());
+  BOOT_PHASE(InitializeTask());
   Task& main_task = task_manager->CurrentTask();
+  BOOT_PHASE(StartApplicationProcessors());
 
-  usb::xhci::Initialize();
-  InitializeKeyboard();
-  InitializeMouse();
+  BOOT_PHASE(usb::xhci::Initialize());
+  BOOT_PHASE(InitializeKeyboard());
+  BOOT_PHASE(InitializeMouse());
 
-  app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
-  task_manager->NewTask()
-    .InitContext(TaskTerminal, 0)
+  BOOT_PHASE(InitializeAppImageCache());
+  lazy_app_load = !BootOptionIs("app_loader", "eager");
+  task_manager->NewTask().value
+    ->InitContext(TaskTerminal, 0)
     .Wakeup();
+  LogBootPhases();
 
   char str[128];
 
   while (true) {
-    __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
 
     sprintf(str, "%010lu", tick);
     FillRectangle(*main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
@@ -208,11 +218,6 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
         break;
       case Message::kTimerTimeout:
         if(msg->arg.timer.value == kTextboxCursorTimer) {
-          __asm__("cli");
-          timer_manager->AddTimer(
-              Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1}
-              );
-          __asm__("sti");
           textbox_cursor_visible = !textbox_cursor_visible;
           DrawTextCursor(textbox_cursor_visible);
           layer_manager->Draw(text_window_layer_id);
@@ -230,15 +235,21 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
             InputTextWindow(msg->arg.keyboard.ascii);
           }
         } else if(msg->arg.keyboard.press && msg->arg.keyboard.keycode == 59 /* 59 */) {
-          task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup();
+          if(auto [ task, err ] = task_manager->NewTask(); err) {
+            Log(kWarn, "failed to open a terminal: %s\n", err.Name());
+          } else {
+            task->InitContext(TaskTerminal, 0).Wakeup();
+          }
         } else {
-          __asm__("cli");
-          auto task_it = layer_task_map->find(act);
-          __asm__("sti");
-          if(task_it != layer_task_map->end()) {
-            __asm__("cli");
-            task_manager->SendMessage(task_it->second, *msg);
-            __asm__("sti");
+          std::optional<uint64_t> task_id;
+          {
+            SpinLockGuard guard{layer_lock};
+            if(auto it = layer_task_map->find(act); it != layer_task_map->end()) {
+              task_id = it->second;
+            }
+          }
+          if(task_id) {
+            task_manager->SendMessage(*task_id, *msg);
           } else {
             printk("Key push not handled : keycode %02x, ascii %02x\n", msg->arg.keyboard.keycode, msg->arg.keyboard.ascii);
           }
@@ -246,9 +257,7 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config_
         break;
       case Message::kLayer:
         ProcessLayerMessage(*msg);
-        __asm__("cli");
         task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-        __asm__("sti");
         break;
       default:
         Log(kError, "Unknown message type: %d\n", msg->type);
@@ -1,62 +1,166 @@
 #include "memory_manager.hpp"
 #include "logger.hpp"
+#include "boot_option.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include <algorithm>
 #include <bitset>
+#include <cstring>
 
-BitmapMemoryManager::BitmapMemoryManager ()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+namespace {
+  const char* const consumer_names[] = {
+    "other", "kernel heap", "page table", "app page", "page cache", "task stack", "usb pool", "slab",
+  };
+  static_assert(sizeof(consumer_names) / sizeof(consumer_names[0]) ==
+      static_cast<int>(MemoryConsumer::kLastOfConsumer));
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  while(true) {
-    size_t i = 0;
-    for(; i < num_frames; i++) {
-      if(start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-      }
-      if(GetBit(FrameID{start_frame_id + i})) {
-        break;
-      }
+const char* MemoryConsumerName(MemoryConsumer consumer) {
+  return consumer_names[static_cast<int>(consumer)];
+}
+
+WithError<FrameID> MemoryManager::Allocate(size_t num_frames, MemoryConsumer consumer) {
+  return AllocateAligned(num_frames, 1, consumer);
+}
+
+WithError<FrameID> MemoryManager::AllocateAligned(size_t num_frames, size_t align_frames,
+    MemoryConsumer consumer) {
+  auto frame = TryAllocate(num_frames, align_frames, consumer);
+  /* reclaimers use the rest of the kernel, which is not for interrupt handlers or other CPUs.
+   * a handler may have interrupted the holder of the kernel lock in the middle of a change */
+  const bool may_reclaim = !InInterruptHandler() &&
+    (task_manager == nullptr || task_manager->HoldsKernelLock());
+  /* under memory pressure, let the reclaimers free some frames one by one until it succeeds */
+  for(auto reclaimer : reclaimers_) {
+    if(!frame.error || reclaimer == nullptr || !may_reclaim) {
+      break;
     }
+    if(reclaimer(num_frames) > 0) {
+      frame = TryAllocate(num_frames, align_frames, consumer);
+    }
+  }
+  return frame;
+}
+
+WithError<FrameID> MemoryManager::TryAllocate(size_t num_frames, size_t align_frames,
+    MemoryConsumer consumer) {
+  SpinLockGuard guard{lock_};
+  auto frame = AllocateFrames(num_frames, align_frames);
+  if(!frame.error) {
+    consumer_frames_[static_cast<int>(consumer)] += num_frames;
+  }
+  return frame;
+}
+
+Error MemoryManager::Free(FrameID start_frame, size_t num_frames, MemoryConsumer consumer) {
+  SpinLockGuard guard{lock_};
+  auto err = FreeFrames(start_frame, num_frames);
+  if(!err) {
+    consumer_frames_[static_cast<int>(consumer)] -= num_frames;
+  }
+  return err;
+}
 
-    if(i == num_frames) {
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-        FrameID{start_frame_id},
-        MAKE_ERROR(Error::kSuccess)
-      };
+void MemoryManager::AddReclaimer(Reclaimer reclaimer) {
+  for(auto& r : reclaimers_) {
+    if(r == nullptr) {
+      r = reclaimer;
+      return;
     }
+  }
+  Log(kError, "too many reclaimers\n");
+}
+
+MemoryStat MemoryManager::Stat() const {
+  SpinLockGuard guard{lock_};
+  return { AllocatedFrames(), TotalFrames(), consumer_frames_ };
+}
+
+void MemoryManager::InitializeRefCounts(FrameID range_end) {
+  const size_t map_bytes = range_end.ID() * sizeof(uint16_t);
+  auto [ map, err ] = Allocate((map_bytes + kBytesPerFrame - 1) / kBytesPerFrame);
+  if(err) {
+    Log(kError, "failed to allocate frame reference counts: %s\n", err.Name());
+    exit(1);
+  }
+  extra_refs_ = reinterpret_cast<uint16_t*>(map.Frame());
+  memset(extra_refs_, 0, map_bytes);
+  ref_frames_ = range_end.ID();
+}
 
-    start_frame_id += i + 1;
+void MemoryManager::AddRef(FrameID frame) {
+  SpinLockGuard guard{lock_};
+  if(frame.ID() < ref_frames_ && extra_refs_[frame.ID()] != std::numeric_limits<uint16_t>::max()) {
+    extra_refs_[frame.ID()]++;
   }
 }
 
-Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for(size_t i = 0; i < num_frames; i++) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
+size_t MemoryManager::RefCount(FrameID frame) const {
+  return frame.ID() < ref_frames_ ? extra_refs_[frame.ID()] + 1 : 1;
+}
+
+Error MemoryManager::Release(FrameID start_frame, size_t num_frames, MemoryConsumer consumer) {
+  {
+    SpinLockGuard guard{lock_};
+    if(start_frame.ID() < ref_frames_ && extra_refs_[start_frame.ID()] > 0) {
+      if(extra_refs_[start_frame.ID()] != std::numeric_limits<uint16_t>::max()) {
+        extra_refs_[start_frame.ID()]--;
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+  return Free(start_frame, num_frames, consumer);
+}
+
+BitmapMemoryManager::BitmapMemoryManager ()
+  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateFrames(size_t num_frames, size_t align_frames) {
+  /* next fit: search from the cursor first, then wrap around to range_begin_ */
+  const size_t cursor = std::max(next_fit_.ID(), range_begin_.ID());
+  size_t start_frame_id = FindFreeFrames(cursor, range_end_.ID(), num_frames, align_frames);
+  if(start_frame_id == kNullFrame.ID()) {
+    start_frame_id = FindFreeFrames(range_begin_.ID(),
+        std::min(cursor + num_frames + align_frames - 1, range_end_.ID()), num_frames, align_frames);
   }
+  if(start_frame_id == kNullFrame.ID()) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  MarkAllocated(FrameID{start_frame_id}, num_frames);
+  next_fit_ = FrameID{start_frame_id + num_frames};
+  return {
+    FrameID{start_frame_id},
+    MAKE_ERROR(Error::kSuccess)
+  };
+}
+
+Error BitmapMemoryManager::FreeFrames(FrameID start_frame, size_t num_frames) {
+  SetBits(start_frame, num_frames, false);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame,
     size_t num_frames) {
-  for(size_t i = 0; i < num_frames; i++) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
-  }
+  SetBits(start_frame, num_frames, true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
   range_begin_ = range_begin;
   range_end_ = range_end;
-}
 
-MemoryStat BitmapMemoryManager::Stat() const {
-  size_t sum = 0;
-  for(int i = range_begin_.ID() / kBitsPerMapLine; i < range_end_.ID() / kBitsPerMapLine; i++) {
-    sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
+  /* count once here, and SetBits keeps the count afterwards */
+  allocated_frames_ = 0;
+  for(size_t id = range_begin_.ID(); id < range_end_.ID(); id++) {
+    if(id % kBitsPerMapLine == 0 && id + kBitsPerMapLine <= range_end_.ID()) {
+      allocated_frames_ += std::bitset<kBitsPerMapLine>(alloc_map_[id / kBitsPerMapLine]).count();
+      id += kBitsPerMapLine - 1;
+    } else if(GetBit(FrameID{id})) {
+      allocated_frames_++;
+    }
   }
-
-  return { sum, range_end_.ID() - range_begin_.ID() };
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -66,37 +170,309 @@ bool BitmapMemoryManager::GetBit(FrameID frame) const {
   return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-  auto line_index = frame.ID() / kBitsPerMapLine; 
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated) {
+  size_t id = start_frame.ID();
+  const size_t end = id + num_frames;
+
+  while(id < end) {
+    const auto line_index = id / kBitsPerMapLine;
+    const auto bit_index = id % kBitsPerMapLine;
+    const size_t n = std::min(end - id, kBitsPerMapLine - bit_index);
+
+    /* n bits from bit_index, or the whole line */
+    const MapLineType mask = n == kBitsPerMapLine
+      ? ~static_cast<MapLineType>(0)
+      : ((static_cast<MapLineType>(1) << n) - 1) << bit_index;
+    if(allocated) {
+      allocated_frames_ += __builtin_popcountl(mask & ~alloc_map_[line_index]);
+      alloc_map_[line_index] |= mask;
+    } else {
+      allocated_frames_ -= __builtin_popcountl(mask & alloc_map_[line_index]);
+      alloc_map_[line_index] &= ~mask;
+    }
 
-  if(allocated) alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
-  else alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    id += n;
+  }
 }
 
-extern "C" caddr_t program_break, program_break_end;
+size_t BitmapMemoryManager::FindFreeFrames(size_t begin, size_t end, size_t num_frames,
+    size_t align_frames) const {
+  size_t id = begin;
+  while(id + num_frames <= end) {
+    /* skip allocated bits a line at a time */
+    const auto line_index = id / kBitsPerMapLine;
+    const auto bit_index = id % kBitsPerMapLine;
+    const MapLineType line = alloc_map_[line_index] |
+      ((static_cast<MapLineType>(1) << bit_index) - 1);
+    if(line == ~static_cast<MapLineType>(0)) {
+      id = (line_index + 1) * kBitsPerMapLine;
+      continue;
+    }
+    id = line_index * kBitsPerMapLine + __builtin_ctzl(~line);
+    if(const size_t aligned = (id + align_frames - 1) & ~(align_frames - 1); aligned != id) {
+      id = aligned;
+      continue;
+    }
+
+    /* measure the free run starting at id */
+    size_t run_end = id;
+    while(run_end < id + num_frames) {
+      const auto run_bit = run_end % kBitsPerMapLine;
+      const MapLineType rest = alloc_map_[run_end / kBitsPerMapLine] >> run_bit;
+      if(rest == 0) {
+        run_end += kBitsPerMapLine - run_bit;
+        continue;
+      }
+      run_end += __builtin_ctzl(rest);
+      break;
+    }
+
+    if(run_end >= id + num_frames) {
+      return id + num_frames <= end ? id : kNullFrame.ID();
+    }
+    id = run_end + 1;
+  }
+  return kNullFrame.ID();
+}
 
 namespace {
-  char memory_manager_buf[sizeof(BitmapMemoryManager)];
+  int CeilOrder(size_t num_frames) {
+    int order = 0;
+    while((static_cast<size_t>(1) << order) < num_frames) {
+      order++;
+    }
+    return order;
+  }
+
+  /* the largest order of a block which starts at frame_id and fits in num_frames */
+  int MaxAlignedOrder(size_t frame_id, size_t num_frames, int max_order) {
+    int order = 63 - __builtin_clzl(num_frames);
+    if(frame_id != 0) {
+      order = std::min(order, __builtin_ctzl(frame_id));
+    }
+    return std::min(order, max_order);
+  }
+}
 
-  Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-    const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if(heap_start.error) {
-      return heap_start.error;
+BuddyMemoryManager::BuddyMemoryManager(BitmapMemoryManager& bitmap)
+  : range_begin_{bitmap.RangeBegin()}, range_end_{bitmap.RangeEnd()} {
+  const size_t num_frames = range_end_.ID() - range_begin_.ID();
+  const size_t map_frames = (num_frames + kBytesPerFrame - 1) / kBytesPerFrame;
+  if(auto [ map, err ] = bitmap.Allocate(map_frames); err) {
+    Log(kError, "failed to allocate buddy order map: %s\n", err.Name());
+    exit(1);
+  } else {
+    order_map_ = reinterpret_cast<uint8_t*>(map.Frame());
+  }
+  memset(order_map_, kNotFreeHead, num_frames);
+
+  allocated_frames_ = num_frames;
+  size_t run_begin = range_begin_.ID();
+  for(size_t id = range_begin_.ID(); id <= range_end_.ID(); id++) {
+    const bool allocated = id == range_end_.ID() || bitmap.IsAllocated(FrameID{id});
+    if(!allocated) {
+      continue;
+    }
+    if(run_begin < id) {
+      FreeRange(run_begin, id);
+    }
+    run_begin = id + 1;
+  }
+}
+
+WithError<FrameID> BuddyMemoryManager::AllocateFrames(size_t num_frames, size_t align_frames) {
+  /* a block of order k is aligned to 2^k frames */
+  const int order = CeilOrder(std::max(num_frames, align_frames));
+  if(order > kMaxOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  int found_order = order;
+  while(found_order <= kMaxOrder && free_lists_[found_order] == nullptr) {
+    found_order++;
+  }
+  if(found_order > kMaxOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  const size_t frame_id = reinterpret_cast<uintptr_t>(free_lists_[found_order]) / kBytesPerFrame;
+  RemoveBlock(frame_id, found_order);
+
+  /* split into halves until the block size fits */
+  while(found_order > order) {
+    found_order--;
+    PushBlock(frame_id + (static_cast<size_t>(1) << found_order), found_order);
+  }
+
+  allocated_frames_ += static_cast<size_t>(1) << order;
+  /* give back the tail which is not requested */
+  FreeRange(frame_id + num_frames, frame_id + (static_cast<size_t>(1) << order));
+
+  return {FrameID{frame_id}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BuddyMemoryManager::FreeFrames(FrameID start_frame, size_t num_frames) {
+  if(start_frame.ID() < range_begin_.ID() || range_end_.ID() < start_frame.ID() + num_frames) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  FreeRange(start_frame.ID(), start_frame.ID() + num_frames);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+  const size_t begin = std::max(start_frame.ID(), range_begin_.ID());
+  const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+
+  size_t id = begin;
+  while(id < end) {
+    size_t head;
+    int order;
+    if(!FindFreeBlock(id, head, order)) {
+      id++;
+      continue;
+    }
+
+    /* carve [id, end) out of the free block and put back the rest */
+    const size_t block_end = head + (static_cast<size_t>(1) << order);
+    const size_t carve_end = std::min(end, block_end);
+    RemoveBlock(head, order);
+    allocated_frames_ += block_end - head;
+    FreeRange(head, id);
+    FreeRange(carve_end, block_end);
+    id = carve_end;
+  }
+}
+
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+  /* the range can only shrink because frames outside the imported range are unknown */
+  if(range_begin_.ID() < range_begin.ID()) {
+    MarkAllocated(range_begin_, range_begin.ID() - range_begin_.ID());
+  }
+  if(range_end.ID() < range_end_.ID()) {
+    MarkAllocated(range_end, range_end_.ID() - range_end.ID());
+  }
+}
+
+void BuddyMemoryManager::PushBlock(size_t frame_id, int order) {
+  auto block = reinterpret_cast<FreeBlock*>(FrameID{frame_id}.Frame());
+  block->prev = nullptr;
+  block->next = free_lists_[order];
+  if(block->next) {
+    block->next->prev = block;
+  }
+  free_lists_[order] = block;
+  order_map_[frame_id - range_begin_.ID()] = order;
+}
+
+void BuddyMemoryManager::RemoveBlock(size_t frame_id, int order) {
+  auto block = reinterpret_cast<FreeBlock*>(FrameID{frame_id}.Frame());
+  if(block->prev) {
+    block->prev->next = block->next;
+  } else {
+    free_lists_[order] = block->next;
+  }
+  if(block->next) {
+    block->next->prev = block->prev;
+  }
+  order_map_[frame_id - range_begin_.ID()] = kNotFreeHead;
+}
+
+void BuddyMemoryManager::FreeBlockCoalesce(size_t frame_id, int order) {
+  allocated_frames_ -= static_cast<size_t>(1) << order;
+
+  while(order < kMaxOrder) {
+    const size_t buddy = frame_id ^ (static_cast<size_t>(1) << order);
+    if(buddy < range_begin_.ID() ||
+       range_end_.ID() < buddy + (static_cast<size_t>(1) << order) ||
+       order_map_[buddy - range_begin_.ID()] != order) {
+      break;
     }
+    RemoveBlock(buddy, order);
+    frame_id = std::min(frame_id, buddy);
+    order++;
+  }
+  PushBlock(frame_id, order);
+}
+
+void BuddyMemoryManager::FreeRange(size_t begin, size_t end) {
+  while(begin < end) {
+    const int order = MaxAlignedOrder(begin, end - begin, kMaxOrder);
+    FreeBlockCoalesce(begin, order);
+    begin += static_cast<size_t>(1) << order;
+  }
+}
+
+bool BuddyMemoryManager::FindFreeBlock(size_t frame_id, size_t& head, int& order) const {
+  for(int k = 0; k <= kMaxOrder; k++) {
+    const size_t h = frame_id & ~((static_cast<size_t>(1) << k) - 1);
+    if(h < range_begin_.ID()) {
+      break;
+    }
+    const uint8_t o = order_map_[h - range_begin_.ID()];
+    if(o != kNotFreeHead && frame_id < h + (static_cast<size_t>(1) << o)) {
+      head = h;
+      order = o;
+      return true;
+    }
+  }
+  return false;
+}
 
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
+extern "C" caddr_t program_break, program_break_end;
+
+namespace {
+  alignas(BitmapMemoryManager) char bitmap_manager_buf[sizeof(BitmapMemoryManager)];
+  alignas(BuddyMemoryManager) char buddy_manager_buf[sizeof(BuddyMemoryManager)];
+
+  /* The kernel heap lives in its own PML4 entry right above the identity mapping.
+   * [kHeapBase, program_break_end) is mapped, and sbrk grows or shrinks it on demand.
+   */
+  const uintptr_t kHeapBase = 512_GiB;
+  const uintptr_t kHeapLimit = kHeapBase + 512_GiB;
+  const size_t kInitialHeapFrames = 256;
+
+  Error InitializeHeap() {
+    program_break = program_break_end = reinterpret_cast<caddr_t>(kHeapBase);
+    if(GrowKernelHeap(program_break + kInitialHeapFrames * kBytesPerFrame - 1) != 0) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
 }
 
-BitmapMemoryManager* memory_manager;
+extern "C" int GrowKernelHeap(caddr_t new_break) {
+  const auto new_end = reinterpret_cast<uintptr_t>(new_break) / kBytesPerFrame * kBytesPerFrame + kBytesPerFrame;
+  if(new_end > kHeapLimit) {
+    return -1;
+  }
+
+  while(reinterpret_cast<uintptr_t>(program_break_end) < new_end) {
+    if(MapKernelPages(reinterpret_cast<uintptr_t>(program_break_end), 1, MemoryConsumer::kKernelHeap)) {
+      return -1;
+    }
+    program_break_end += kBytesPerFrame;
+  }
+  return 0;
+}
+
+extern "C" void ShrinkKernelHeap() {
+  /* newlib trims the heap top only when a large region at the top is free */
+  const auto new_end = (reinterpret_cast<uintptr_t>(program_break) + kBytesPerFrame - 1) / kBytesPerFrame * kBytesPerFrame;
+  const auto end = reinterpret_cast<uintptr_t>(program_break_end);
+  if(new_end >= end) {
+    return;
+  }
+  UnmapKernelPages(new_end, (end - new_end) / kBytesPerFrame, MemoryConsumer::kKernelHeap);
+  program_break_end = reinterpret_cast<caddr_t>(new_end);
+}
+
+MemoryManager* memory_manager;
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-  ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+  /* the bitmap manager always collects the memory map, and the buddy manager takes over if selected by "memory_manager=buddy" */
+  auto bitmap_manager = new(bitmap_manager_buf) BitmapMemoryManager;
+  ::memory_manager = bitmap_manager;
   const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
 
   uintptr_t available_end = 0;
@@ -122,9 +498,16 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
     }
   }
 
+  /* the startup code of application processors is copied here */
+  memory_manager->MarkAllocated(FrameID{kAPBootAddress / kBytesPerFrame}, 1);
   memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
 
-  if(auto err = InitializeHeap(*memory_manager)) {
+  if(BootOptionIs("memory_manager", "buddy")) {
+    ::memory_manager = new(buddy_manager_buf) BuddyMemoryManager{*bitmap_manager};
+  }
+  ::memory_manager->InitializeRefCounts(FrameID{available_end / kBytesPerFrame});
+
+  if(auto err = InitializeHeap()) {
     Log(kError, "failed to allocate pages: %s at %s:%d\n", err.Name(), err.File(), err.Line());
     exit(1);
   }
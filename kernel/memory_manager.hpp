@@ -3,6 +3,7 @@
 #include <limits>
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace {
   constexpr unsigned long long operator""_KiB(unsigned long long kib) { return kib * 1024; }
@@ -30,12 +31,72 @@ class FrameID {
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+/* who holds the allocated frames. Allocate and Free must be given the same consumer. */
+enum class MemoryConsumer {
+  kOther,
+  kKernelHeap,
+  kPageTable,
+  kAppPage,    /* user pages of apps: ELF segments, stacks and demand pages */
+  kPageCache,  /* pages of file mappings */
+  kTaskStack,
+  kUSBPool,
+  kSlab,       /* slabs of the object caches */
+  kLastOfConsumer,
+};
+
+const char* MemoryConsumerName(MemoryConsumer consumer);
+
 struct MemoryStat {
   size_t allocated_frames;
   size_t total_frames;
+  std::array<size_t, static_cast<int>(MemoryConsumer::kLastOfConsumer)> consumer_frames;
 };
 
-class BitmapMemoryManager {
+class MemoryManager {
+  public:
+    virtual ~MemoryManager() = default;
+    WithError<FrameID> Allocate(size_t num_frames, MemoryConsumer consumer = MemoryConsumer::kOther);
+    /* the first frame ID is a multiple of align_frames, which must be a power of 2 */
+    WithError<FrameID> AllocateAligned(size_t num_frames, size_t align_frames,
+        MemoryConsumer consumer = MemoryConsumer::kOther);
+    Error Free(FrameID start_frame, size_t num_frames, MemoryConsumer consumer = MemoryConsumer::kOther);
+    virtual void MarkAllocated(FrameID start_frame, size_t num_frames) = 0;
+    virtual void SetMemoryRange(FrameID range_begin, FrameID range_end) = 0;
+    MemoryStat Stat() const;
+    virtual const char* Name() const = 0;
+
+    /* Frames mapped into several page maps are shared by reference counting.
+     * Allocated frames have one reference. Release drops one and frees the frames at the last.
+     * A page of several frames is counted at its first frame.
+     */
+    void InitializeRefCounts(FrameID range_end);
+    void AddRef(FrameID frame);
+    size_t RefCount(FrameID frame) const;
+    Error Release(FrameID start_frame, size_t num_frames, MemoryConsumer consumer = MemoryConsumer::kOther);
+
+    /* called in the order added when an allocation fails, to free up to num_frames frames.
+     * returns the number freed. only tasks holding the kernel lock call them */
+    using Reclaimer = size_t (*)(size_t num_frames);
+    void AddReclaimer(Reclaimer reclaimer);
+  protected:
+    virtual WithError<FrameID> AllocateFrames(size_t num_frames, size_t align_frames) = 0;
+    virtual Error FreeFrames(FrameID start_frame, size_t num_frames) = 0;
+    /* both are kept up to date incrementally, so Stat() is O(1) */
+    virtual size_t AllocatedFrames() const = 0;
+    virtual size_t TotalFrames() const = 0;
+  private:
+    /* guards the frames and their counts. reclaimers are called without it */
+    mutable SpinLock lock_;
+    std::array<size_t, static_cast<int>(MemoryConsumer::kLastOfConsumer)> consumer_frames_{};
+    /* references minus one for each frame. a saturated count is never released */
+    uint16_t* extra_refs_{nullptr};
+    size_t ref_frames_{0};
+    std::array<Reclaimer, 4> reclaimers_{};
+
+    WithError<FrameID> TryAllocate(size_t num_frames, size_t align_frames, MemoryConsumer consumer);
+};
+
+class BitmapMemoryManager : public MemoryManager {
   public:
     static const auto kMaxPhysicalMemoryBytes{128_GiB};
     static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
@@ -45,21 +106,77 @@ class BitmapMemoryManager {
 
     BitmapMemoryManager();
 
-    WithError<FrameID> Allocate(size_t num_frames);
-    Error Free(FrameID start_frame, size_t num_frames);
-    void MarkAllocated(FrameID start_frame, size_t num_frames);
+    void MarkAllocated(FrameID start_frame, size_t num_frames) override;
 
-    void SetMemoryRange(FrameID range_begin, FrameID range_end);
+    void SetMemoryRange(FrameID range_begin, FrameID range_end) override;
 
-    MemoryStat Stat() const;
+    const char* Name() const override { return "bitmap"; }
+
+    bool IsAllocated(FrameID frame) const { return GetBit(frame); }
+    FrameID RangeBegin() const { return range_begin_; }
+    FrameID RangeEnd() const { return range_end_; }
+  protected:
+    WithError<FrameID> AllocateFrames(size_t num_frames, size_t align_frames) override;
+    Error FreeFrames(FrameID start_frame, size_t num_frames) override;
+    size_t AllocatedFrames() const override { return allocated_frames_; }
+    size_t TotalFrames() const override { return range_end_.ID() - range_begin_.ID(); }
   private:
     std::array<MapLineType, kFrameCount/kBitsPerMapLine> alloc_map_;
     FrameID range_begin_;
     FrameID range_end_;
+    FrameID next_fit_{0};
+    size_t allocated_frames_{0};
 
     bool GetBit(FrameID frame) const;
-    void SetBit(FrameID frame, bool allocated);
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+    size_t FindFreeFrames(size_t begin, size_t end, size_t num_frames, size_t align_frames) const;
 };
 
-extern BitmapMemoryManager* memory_manager;
+/* Binary buddy allocator.
+ * A free block of order k is 2^k frames long and aligned to 2^k frames.
+ * Free blocks are linked through their own first frame, and order_map_ records
+ * the order of each free block head so Free() can find and coalesce buddies.
+ */
+class BuddyMemoryManager : public MemoryManager {
+  public:
+    static const int kMaxOrder = 18; /* 2^18 frames = 1 GiB */
+
+    /* takes over the free frames of a bitmap manager whose range has already been set */
+    BuddyMemoryManager(BitmapMemoryManager& bitmap);
+
+    void MarkAllocated(FrameID start_frame, size_t num_frames) override;
+
+    void SetMemoryRange(FrameID range_begin, FrameID range_end) override;
+
+    const char* Name() const override { return "buddy"; }
+  protected:
+    WithError<FrameID> AllocateFrames(size_t num_frames, size_t align_frames) override;
+    Error FreeFrames(FrameID start_frame, size_t num_frames) override;
+    size_t AllocatedFrames() const override { return allocated_frames_; }
+    size_t TotalFrames() const override { return range_end_.ID() - range_begin_.ID(); }
+  private:
+    struct FreeBlock {
+      FreeBlock* next;
+      FreeBlock* prev;
+    };
+    static const uint8_t kNotFreeHead = 0xff;
+
+    std::array<FreeBlock*, kMaxOrder + 1> free_lists_{};
+    uint8_t* order_map_{nullptr};
+    FrameID range_begin_;
+    FrameID range_end_;
+    size_t allocated_frames_{0};
+
+    void PushBlock(size_t frame_id, int order);
+    void RemoveBlock(size_t frame_id, int order);
+    void FreeBlockCoalesce(size_t frame_id, int order);
+    void FreeRange(size_t begin, size_t end);
+    bool FindFreeBlock(size_t frame_id, size_t& head, int& order) const;
+};
+
+extern MemoryManager* memory_manager;
 void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/* called by sbrk() to map the kernel heap up to new_break, and to unmap it above the break */
+extern "C" int GrowKernelHeap(char* new_break);
+extern "C" void ShrinkKernelHeap();
@@ -8,14 +8,24 @@ void _exit(void) {
 
 caddr_t program_break, program_break_end;
 
+int GrowKernelHeap(caddr_t new_break);
+void ShrinkKernelHeap(void);
+
 caddr_t sbrk(int incr) {
-  if(program_break == 0 || program_break + incr >= program_break_end) {
+  if(program_break == 0) {
+    errno = ENOMEM;
+    return (caddr_t) - 1;
+  }
+  if(program_break + incr >= program_break_end && GrowKernelHeap(program_break + incr) != 0) {
     errno = ENOMEM;
     return (caddr_t) - 1;
   }
 
   caddr_t prev_break = program_break;
   program_break += incr;
+  if(incr < 0) {
+    ShrinkKernelHeap();
+  }
   return prev_break;
 }
 
@@ -0,0 +1,117 @@
+#include "page_cache.hpp"
+#include <cstring>
+
+namespace {
+  const size_t kPageSize = 4096;
+}
+
+SlabCache PageCache::entry_cache_{"pcache", sizeof(PageCache::Entry)};
+
+WithError<FrameID> PageCache::Get(FileDescriptor& fd, size_t offset) {
+  const uint64_t cache_id = fd.CacheID();
+  if(auto e = Find(cache_id, offset)) {
+    hits_++;
+    UnlinkLRU(e);
+    LinkLRU(e);
+    return { e->frame, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  misses_++;
+  auto [ frame, err ] = memory_manager->Allocate(1, MemoryConsumer::kPageCache);
+  if(err) {
+    return { kNullFrame, err };
+  }
+  auto page = reinterpret_cast<uint8_t*>(frame.Frame());
+  const size_t n = fd.Load(page, kPageSize, offset);
+  memset(page + n, 0, kPageSize - n);
+
+  auto& bucket = Bucket(cache_id, offset);
+  auto e = new(entry_cache_.Allocate()) Entry{cache_id, offset, frame, bucket, nullptr, nullptr};
+  bucket = e;
+  LinkLRU(e);
+  pages_++;
+  return { frame, MAKE_ERROR(Error::kSuccess) };
+}
+
+void PageCache::Drop(uint64_t cache_id, size_t offset, size_t len) {
+  for(size_t page = offset & ~(kPageSize - 1); page < offset + len; page += kPageSize) {
+    if(auto e = Find(cache_id, page)) {
+      Remove(e);
+    }
+  }
+}
+
+size_t PageCache::Reclaim(size_t num_frames) {
+  size_t freed = 0;
+  for(Entry* e = lru_tail_; e && freed < num_frames; ) {
+    Entry* prev = e->lru_prev;
+    /* frames which tasks still map are not freed by evicting them */
+    if(memory_manager->RefCount(e->frame) == 1) {
+      Remove(e);
+      evictions_++;
+      freed++;
+    }
+    e = prev;
+  }
+  return freed;
+}
+
+PageCache::Entry*& PageCache::Bucket(uint64_t cache_id, size_t offset) {
+  const uint64_t h = (cache_id * 0x9e3779b97f4a7c15ull) ^ (offset / kPageSize);
+  return buckets_[h % kNumBuckets];
+}
+
+PageCache::Entry* PageCache::Find(uint64_t cache_id, size_t offset) {
+  for(Entry* e = Bucket(cache_id, offset); e; e = e->hash_next) {
+    if(e->cache_id == cache_id && e->offset == offset) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+void PageCache::LinkLRU(Entry* e) {
+  e->lru_prev = nullptr;
+  e->lru_next = lru_head_;
+  if(lru_head_) {
+    lru_head_->lru_prev = e;
+  } else {
+    lru_tail_ = e;
+  }
+  lru_head_ = e;
+}
+
+void PageCache::UnlinkLRU(Entry* e) {
+  if(e->lru_prev) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    lru_head_ = e->lru_next;
+  }
+  if(e->lru_next) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    lru_tail_ = e->lru_prev;
+  }
+}
+
+void PageCache::Remove(Entry* e) {
+  for(Entry** p = &Bucket(e->cache_id, e->offset); *p; p = &(*p)->hash_next) {
+    if(*p == e) {
+      *p = e->hash_next;
+      break;
+    }
+  }
+  UnlinkLRU(e);
+  memory_manager->Release(e->frame, 1, MemoryConsumer::kPageCache);
+  entry_cache_.Free(e);
+  pages_--;
+}
+
+PageCache* page_cache;
+
+void InitializePageCache() {
+  page_cache = new PageCache;
+  memory_manager->AddReclaimer([](size_t num_frames) {
+    return page_cache->Reclaim(num_frames);
+  });
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+#include "file.hpp"
+#include "memory_manager.hpp"
+#include "slab.hpp"
+
+/* System-wide cache of file pages, keyed by the cache ID of the file and the page offset.
+ * A cached frame holds one reference of its own, so tasks mapping it share it copy on write.
+ * Pages no task maps any more are evicted in LRU order when the memory manager runs short.
+ */
+class PageCache {
+  public:
+    static const size_t kNumBuckets = 1024;
+
+    /* the frame holding the 4 KiB at offset of fd. a miss allocates and loads a new one */
+    WithError<FrameID> Get(FileDescriptor& fd, size_t offset);
+    /* forgets the pages of the file overlapping [offset, offset + len), e.g. when they are written */
+    void Drop(uint64_t cache_id, size_t offset, size_t len);
+    /* evicts unmapped pages from the LRU end until num_frames frames are freed */
+    size_t Reclaim(size_t num_frames);
+
+    size_t Pages() const { return pages_; }
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+    size_t Evictions() const { return evictions_; }
+  private:
+    struct Entry {
+      uint64_t cache_id;
+      size_t offset;
+      FrameID frame;
+      Entry* hash_next;
+      Entry* lru_prev;
+      Entry* lru_next;
+    };
+    static SlabCache entry_cache_;
+
+    std::array<Entry*, kNumBuckets> buckets_{};
+    Entry* lru_head_{nullptr}; /* most recently used */
+    Entry* lru_tail_{nullptr};
+    size_t pages_{0}, hits_{0}, misses_{0}, evictions_{0};
+
+    Entry*& Bucket(uint64_t cache_id, size_t offset);
+    Entry* Find(uint64_t cache_id, size_t offset);
+    void LinkLRU(Entry* e);
+    void UnlinkLRU(Entry* e);
+    void Remove(Entry* e);
+};
+
+extern PageCache* page_cache;
+void InitializePageCache();
@@ -1,50 +1,159 @@
 #include "paging.hpp"
 #include <array>
+#include <bitset>
+#include <cpuid.h>
 #include "asmfunc.h"
+#include "graphics.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
 #include "task.hpp"
+#include "smp.hpp"
 #include "logger.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
   const uint64_t kPageSize2M = 512 * kPageSize4K;
   const uint64_t kPageSize1G = 512 * kPageSize2M;
+  const size_t kFramesPer2M = kPageSize2M / kPageSize4K;
+  const size_t kFaultAroundPages = 16;
+  const size_t kMaxReadaheadPages = 256;
 
   alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
   alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  const uint64_t kCR4PGE = 1 << 7;
+  const uint64_t kCR4PCIDE = 1 << 17;
+  const unsigned int kCPUIDPCID = 1 << 17; /* CPUID.01H:ECX */
+  const unsigned int kCPUIDPage1GB = 1 << 26; /* CPUID.80000001H:EDX */
+
+  bool page_1g_supported = false;
+  /* [0, identity_map_gib GiB) is identity mapped */
+  size_t identity_map_gib = 0;
+
+  /* PCID 0 is used by the kernel page map */
+  bool pcid_enabled = false;
+  std::bitset<4096> pcid_used{1};
 }
 
-void SetupIdentityPageTable() {
+uint64_t cr3_no_flush = 0;
+
+void SetupIdentityPageTable(uint64_t end) {
   pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
-  for(int i_pdpt = 0; i_pdpt < page_directory.size(); i_pdpt++) {
-    pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
+  if(ExtendIdentityMap(end)) {
+    Log(kWarn, "identity map is limited to %lu GiB\n", identity_map_gib);
+  }
 
+  ResetCR3();
+  /* CR0.WP: the kernel must not write through read-only app pages, which may be shared */
+  SetCR0(GetCR0() | 0x10000);
+  SetCR4(GetCR4() | kCR4PGE);
+}
+
+Error ExtendIdentityMap(uint64_t end) {
+  /* 2 MiB pages need one of the static page directories per GiB */
+  const size_t max_gib = page_1g_supported ? pdp_table.size() : page_directory.size();
+  const size_t gib = std::min<size_t>((end + kPageSize1G - 1) / kPageSize1G, max_gib);
+
+  /* global pages: the identity map is the same in every address space */
+  for(size_t i_pdpt = identity_map_gib; i_pdpt < gib; i_pdpt++) {
+    if(page_1g_supported) {
+      pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x183;
+      continue;
+    }
+
+    pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
     for(int i_pd = 0; i_pd < 512; i_pd++) {
-      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+      page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
     }
   }
+  identity_map_gib = std::max(identity_map_gib, gib);
 
-  ResetCR3();
-  SetCR0(GetCR0() & 0xfffeffff);
+  if(identity_map_gib * kPageSize1G < end) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
-void InitializePaging() {
-  SetupIdentityPageTable();
+void InitializePaging(const MemoryMap& memory_map) {
+  unsigned int eax, ebx, ecx, edx;
+  page_1g_supported = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & kCPUIDPage1GB);
+
+  /* all of the memory map, and at least 4 GiB for the local APIC and PCI devices below 4 GiB */
+  uint64_t end = 4 * kPageSize1G;
+  const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+  for(uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size; iter += memory_map.descriptor_size) {
+    auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+    end = std::max(end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+  }
+  const auto frame_buffer = reinterpret_cast<uint64_t>(screen_config.frame_buffer);
+  end = std::max(end, frame_buffer + 4 * screen_config.pixels_per_scan_line * screen_config.vertical_resolution);
+
+  SetupIdentityPageTable(end);
+  Log(kInfo, "identity map: %lu GiB with %s pages\n", identity_map_gib, page_1g_supported ? "1 GiB" : "2 MiB");
+
+  if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & kCPUIDPCID)) {
+    SetCR4(GetCR4() | kCR4PCIDE);
+    pcid_enabled = true;
+    cr3_no_flush = static_cast<uint64_t>(1) << 63;
+  }
+  Log(kInfo, "PCID: %s\n", pcid_enabled ? "enabled" : "not supported");
 }
 
 void ResetCR3() {
-  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]) | cr3_no_flush);
+}
+
+PageMapEntry* CurrentPML4() {
+  return CR3ToPML4(GetCR3());
+}
+
+WithError<uint64_t> MakeCR3(PageMapEntry* pml4) {
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4);
+  if(!pcid_enabled) {
+    return { cr3, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  for(size_t pcid = 1; pcid < pcid_used.size(); pcid++) {
+    if(!pcid_used[pcid]) {
+      pcid_used.set(pcid);
+      return { cr3 | pcid, MAKE_ERROR(Error::kSuccess) };
+    }
+  }
+  return { 0, MAKE_ERROR(Error::kFull) };
+}
+
+void ReleaseCR3(uint64_t cr3) {
+  if(const auto pcid = cr3 & kCR3PCIDMask; pcid != 0) {
+    pcid_used.reset(pcid);
+  }
 }
 
 namespace {
-  WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+  FrameID FrameOf(const PageMapEntry& entry) {
+    return FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame};
+  }
+
+  MemoryConsumer LeafConsumer(const PageMapEntry& entry) {
+    return entry.bits.page_cache ? MemoryConsumer::kPageCache : MemoryConsumer::kAppPage;
+  }
+
+  /* maps the leaf of src into dest as well. both become read-only and copy on write */
+  void ShareLeaf(PageMapEntry& dest, PageMapEntry& src) {
+    src.bits.writable = 0;
+    dest = src;
+    if(!src.bits.volume) { /* pages of the volume image are not counted */
+      memory_manager->AddRef(FrameOf(src));
+    }
+  }
+
+  WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry, MemoryConsumer consumer) {
     if(entry.bits.present) { /* check entry is already set */
       return { entry.Pointer(), MAKE_ERROR(Error::kSuccess) };
     }
 
     /* As blow, entry is stil invalid */
-    auto [child_map, err] = NewPageMap();
+    auto [child_map, err] = NewPageMap(consumer);
     if(err) {
       return {nullptr, err};
     }
@@ -56,10 +165,12 @@ namespace {
   }
 
   WithError<size_t> SetupPageMap(
-      PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages, bool writable) {
+      PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kpages, bool writable,
+      MemoryConsumer consumer) {
     while(num_4kpages > 0) {
       const auto entry_index = addr.Part(page_map_level);
-      auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
+      auto [child_map, err] = SetNewPageMapIfNotPresent(
+          page_map[entry_index], page_map_level == 1 ? consumer : MemoryConsumer::kPageTable);
 
       if(err) {
         return { num_4kpages, err };
@@ -69,11 +180,12 @@ namespace {
 
       if(page_map_level == 1) {
         page_map[entry_index].bits.writable = writable;
+        page_map[entry_index].bits.page_cache = consumer == MemoryConsumer::kPageCache;
         num_4kpages--;
       } else {
         page_map[entry_index].bits.writable = true;
         auto [ num_remain_pages, err ] = 
-          SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+          SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable, consumer);
         if(err) {
           return {num_4kpages, err};
         }
@@ -94,21 +206,31 @@ namespace {
     return {num_4kpages, MAKE_ERROR(Error::kSuccess)};
   }
 
+  /* drops the frames of a leaf entry and clears it.
+   * leaf frames may be shared with other page maps by CopyPageMaps, and pages of the volume image are never freed */
+  Error ReleaseLeaf(PageMapEntry& entry, size_t num_frames) {
+    auto err = MAKE_ERROR(Error::kSuccess);
+    if(!entry.bits.volume) {
+      err = memory_manager->Release(FrameOf(entry), num_frames, LeafConsumer(entry));
+    }
+    entry.data = 0;
+    return err;
+  }
+
   Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
     for(int i = addr.Part(page_map_level); i < 512; i++) {
       auto entry = page_map[i];
       if(!entry.bits.present) continue;
 
-      if(page_map_level > 1) {
+      const bool huge = page_map_level == 2 && entry.bits.huge_page;
+      if(page_map_level > 1 && !huge) {
         if(auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
           return err;
         }
-      }
-
-      if(entry.bits.writable) {
-        const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-        const FrameID map_frame{entry_addr / kBytesPerFrame};
-        if(auto err = memory_manager->Free(map_frame, 1)) return err;
+        /* page tables are never shared */
+        if(auto err = memory_manager->Free(FrameOf(entry), 1, MemoryConsumer::kPageTable)) return err;
+      } else if(auto err = ReleaseLeaf(page_map[i], huge ? kFramesPer2M : 1)) {
+        return err;
       }
       page_map[i].data = 0;
     }
@@ -116,8 +238,8 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
    
-  const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps, uint64_t causal_addr) {
-    for(const FileMapping& m : fmaps) {
+  FileMapping* FindFileMapping(std::vector<FileMapping>& fmaps, uint64_t causal_addr) {
+    for(FileMapping& m : fmaps) {
       if(m.vaddr_begin <= causal_addr && causal_addr < m.vaddr_end) {
         return &m;
       }
@@ -125,47 +247,279 @@ namespace {
     return nullptr;
   }
 
-  Error PreparePageCache(FileDescriptor& fd, const FileMapping& m, uint64_t causal_addr) {
-    LinearAddress4Level page_vaddr{causal_addr};
-    page_vaddr.parts.offset = 0;
-    if(auto err = SetupPageMaps(page_vaddr, 1)) { /* page allocation */
+  /* true if the 2 MiB aligned region around addr lies in [begin, end) */
+  bool FitsHugePage(uint64_t addr, uint64_t begin, uint64_t end) {
+    const uint64_t huge_begin = addr & ~(kPageSize2M - 1);
+    return begin <= huge_begin && huge_begin + kPageSize2M <= end;
+  }
+
+  /* Maps a zero-filled 2 MiB page at the 2 MiB aligned addr.
+   * This fails if a page table is already there or no aligned frames are left,
+   * and then the caller falls back to 4 KiB pages.
+   */
+  Error SetupHugePage(LinearAddress4Level addr, MemoryConsumer consumer) {
+    auto page_map = CurrentPML4();
+    for(int level = 4; level > 2; level--) {
+      auto& entry = page_map[addr.Part(level)];
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, MemoryConsumer::kPageTable);
+      if(err) {
+        return err;
+      }
+      entry.bits.user = 1;
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+
+    auto& entry = page_map[addr.Part(2)];
+    if(entry.bits.present) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    auto [ frame, err ] = memory_manager->AllocateAligned(kFramesPer2M, kFramesPer2M, consumer);
+    if(err) {
       return err;
     }
+    memset(frame.Frame(), 0, kPageSize2M);
 
-    const long file_offset = page_vaddr.value - m.vaddr_begin;
-    void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-    fd.Load(page_cache, 4096, file_offset);
+    entry.data = 0;
+    entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+    entry.bits.present = 1;
+    entry.bits.writable = 1;
+    entry.bits.user = 1;
+    entry.bits.huge_page = 1;
+    entry.bits.page_cache = consumer == MemoryConsumer::kPageCache;
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error SetPageContent(PageMapEntry* table, int part, LinearAddress4Level addr, PageMapEntry* content) {
-    if(part == 1) {
-      const auto i = addr.Part(part); /* get PT index which is equivalent to address*/
-      table[i].SetPointer(content);
-      table[i].bits.writable = 1;
-      InvalidateTLB(addr.value);
+  /* the entry which maps addr, either a PT entry or a PD entry of a 2 MiB page.
+   * nullptr for a 1 GiB page too: only the identity map uses them, and no app page is in it */
+  PageMapEntry* FindLeafEntry(PageMapEntry* table, int part, LinearAddress4Level addr, int& leaf_part) {
+    auto& entry = table[addr.Part(part)];
+    if(!entry.bits.present || (part == 3 && entry.bits.huge_page)) {
+      return nullptr;
+    }
+    if(part == 1 || (part == 2 && entry.bits.huge_page)) {
+      leaf_part = part;
+      return &entry;
+    }
+    return FindLeafEntry(entry.Pointer(), part - 1, addr, leaf_part);
+  }
+
+  /* copies the page of causal_addr on write. app_range tells that the address belongs to the app */
+  Error CopyOnePage(uint64_t causal_addr, bool app_range) {
+    int leaf_part;
+    auto entry = FindLeafEntry(CurrentPML4(), 4,
+        LinearAddress4Level{causal_addr}, leaf_part);
+    if(entry == nullptr) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    /* pages of the kernel are never copied on write, so writing them is just a violation */
+    if(!app_range && !entry->bits.user) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    const uint64_t page_bytes = leaf_part == 2 ? kPageSize2M : kPageSize4K;
+    const size_t num_frames = page_bytes / kPageSize4K;
+    const auto aligned_addr = causal_addr & ~(page_bytes - 1);
+    const FrameID old_frame = FrameOf(*entry);
+
+    /* nobody else maps the frame any more, so just make it writable.
+     * a page of the volume image is always copied, so the file stays as it is */
+    if(!entry->bits.volume && memory_manager->RefCount(old_frame) == 1) {
+      entry->bits.writable = 1;
+      InvalidateTLB(aligned_addr);
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    const auto i = addr.Part(part);
-    return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+    auto [ frame, err ] = memory_manager->AllocateAligned(num_frames, num_frames, MemoryConsumer::kAppPage);
+    if(err) {
+      return err;
+    }
+    memcpy(frame.Frame(), reinterpret_cast<const void*>(aligned_addr), page_bytes);
+
+    const auto old_consumer = LeafConsumer(*entry);
+    const bool old_volume = entry->bits.volume;
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+    entry->bits.writable = 1;
+    entry->bits.page_cache = 0;
+    entry->bits.volume = 0;
+    InvalidateTLB(aligned_addr);
+    if(old_volume) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return memory_manager->Release(old_frame, num_frames, old_consumer);
   }
 
-  Error CopyOnePage(uint64_t causal_addr) {
-    auto [ p, err ] = NewPageMap();
+  /* replaces a 2 MiB page with a page table of 512 4 KiB pages of the same frames */
+  Error SplitHugePage(PageMapEntry& pd_entry) {
+    auto [ pt, err ] = NewPageMap();
     if(err) {
       return err;
     }
 
-    const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-    memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-    return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4, LinearAddress4Level{causal_addr}, p);
+    const uint64_t frame_addr = reinterpret_cast<uint64_t>(pd_entry.Pointer());
+    for(int i = 0; i < 512; i++) {
+      pt[i] = pd_entry;
+      pt[i].bits.huge_page = 0;
+      pt[i].SetPointer(reinterpret_cast<PageMapEntry*>(frame_addr + i * kPageSize4K));
+    }
+
+    pd_entry.data = 0;
+    pd_entry.SetPointer(pt);
+    pd_entry.bits.present = 1;
+    pd_entry.bits.writable = 1;
+    pd_entry.bits.user = 1;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  bool IsMapped(uint64_t addr) {
+    int leaf_part;
+    return FindLeafEntry(CurrentPML4(), 4, LinearAddress4Level{addr}, leaf_part) != nullptr;
+  }
+
+  /* maps the page of the volume image or of the page cache to addr, read-only so that writes copy it */
+  Error MapSharedPage(LinearAddress4Level addr, void* page, bool volume) {
+    auto page_map = CurrentPML4();
+    for(int level = 4; level > 1; level--) {
+      auto& entry = page_map[addr.Part(level)];
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, MemoryConsumer::kPageTable);
+      if(err) {
+        return err;
+      }
+      entry.bits.user = 1;
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+
+    auto& entry = page_map[addr.Part(1)];
+    entry.data = 0;
+    entry.SetPointer(reinterpret_cast<PageMapEntry*>(page));
+    entry.bits.present = 1;
+    entry.bits.user = 1;
+    entry.bits.page_cache = !volume;
+    entry.bits.volume = volume;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /* Maps the pages of [begin, end) which are not mapped yet.
+   * Whole file pages stored contiguously in the volume image are mapped as they are,
+   * and the other whole pages of cacheable files are shared with the page cache.
+   * Each run of the remaining pages, including all of a shared mapping, is allocated and loaded with one Load.
+   */
+  Error LoadFilePages(const FileMapping& m, uint64_t begin, uint64_t end) {
+    FileDescriptor& fd = *m.fd;
+    /* shared mappings are written through, so they get frames of their own */
+    auto is_private = [&](uint64_t addr) {
+      return m.shared || fd.CacheID() == 0 || addr - m.vaddr_begin + kPageSize4K > m.length;
+    };
+
+    uint64_t addr = begin;
+    while(addr < end) {
+      if(IsMapped(addr)) {
+        addr += kPageSize4K;
+        continue;
+      }
+
+      const uint64_t rel = addr - m.vaddr_begin;
+      if(!is_private(addr)) {
+        if(auto page = fd.PageAddress(m.file_offset + rel)) {
+          if(auto err = MapSharedPage(LinearAddress4Level{addr}, page, true)) {
+            return err;
+          }
+          addr += kPageSize4K;
+          continue;
+        }
+
+        auto [ frame, err ] = page_cache->Get(fd, m.file_offset + rel);
+        if(err) {
+          return err;
+        }
+        /* take the reference first: allocating page tables below may reclaim unreferenced cache pages */
+        memory_manager->AddRef(frame);
+        if(auto err = MapSharedPage(LinearAddress4Level{addr}, frame.Frame(), false)) {
+          memory_manager->Release(frame, 1, MemoryConsumer::kPageCache);
+          return err;
+        }
+        addr += kPageSize4K;
+        continue;
+      }
+
+      uint64_t run_end = addr + kPageSize4K;
+      while(run_end < end && !IsMapped(run_end) && is_private(run_end)) {
+        run_end += kPageSize4K;
+      }
+      if(auto err = SetupPageMaps(LinearAddress4Level{addr}, (run_end - addr) / kPageSize4K,
+            true, MemoryConsumer::kPageCache)) {
+        return err;
+      }
+      if(rel < m.length) {
+        fd.Load(reinterpret_cast<void*>(addr), std::min(run_end - addr, m.length - rel), m.file_offset + rel);
+      }
+      if(m.shared) { /* loading the pages made them dirty */
+        for(; addr < run_end; addr += kPageSize4K) {
+          int leaf_part;
+          FindLeafEntry(CurrentPML4(), 4, LinearAddress4Level{addr}, leaf_part)->bits.dirty = 0;
+          InvalidateTLB(addr);
+        }
+      }
+      addr = run_end;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error PreparePageCache(FileMapping& m, uint64_t causal_addr) {
+    /* pages of cacheable files are shared rather than copied to a private 2 MiB page.
+     * neither are shared mappings, so that one written byte does not make 2 MiB to write back */
+    const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+    const uint64_t huge_begin = causal_addr & ~(kPageSize2M - 1);
+    if(!m.shared && m.fd->CacheID() == 0 &&
+       FitsHugePage(causal_addr, m.vaddr_begin, m.vaddr_end) &&
+       !SetupHugePage(LinearAddress4Level{huge_begin}, MemoryConsumer::kPageCache)) {
+      const uint64_t rel = huge_begin - m.vaddr_begin;
+      if(rel < m.length) {
+        m.fd->Load(reinterpret_cast<void*>(huge_begin), std::min(kPageSize2M, m.length - rel), m.file_offset + rel);
+      }
+      m.next_fault_addr = huge_begin + kPageSize2M;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /* fault-around: map the aligned block of pages around the fault,
+     * or read ahead twice as far as last time if the access looks sequential */
+    uint64_t begin;
+    if(page == m.next_fault_addr) {
+      m.readahead_pages = std::min(m.readahead_pages * 2, kMaxReadaheadPages);
+      begin = page;
+    } else {
+      m.readahead_pages = kFaultAroundPages;
+      begin = std::max(page & ~(kFaultAroundPages * kPageSize4K - 1), m.vaddr_begin);
+    }
+    const uint64_t end = std::min(begin + m.readahead_pages * kPageSize4K, m.vaddr_end);
+    m.next_fault_addr = end;
+    return LoadFilePages(m, begin, end);
+  }
+
+  /* returns the PT entry of addr in the kernel page tables, or nullptr if it has no PT and create is false */
+  WithError<PageMapEntry*> KernelPageEntry(uint64_t addr, bool create) {
+    auto table = reinterpret_cast<PageMapEntry*>(pml4_table.data());
+    const LinearAddress4Level a{addr};
+    for(int level = 4; level > 1; level--) {
+      auto& entry = table[a.Part(level)];
+      if(!entry.bits.present && !create) {
+        return { nullptr, MAKE_ERROR(Error::kSuccess) };
+      }
+      auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, MemoryConsumer::kPageTable);
+      if(err) {
+        return { nullptr, err };
+      }
+      entry.bits.writable = 1;
+      table = child_map;
+    }
+    return { &table[a.Part(1)], MAKE_ERROR(Error::kSuccess) };
   }
  
 }
 
-WithError<PageMapEntry*> NewPageMap() {
-  auto frame = memory_manager->Allocate(1);
+WithError<PageMapEntry*> NewPageMap(MemoryConsumer consumer) {
+  auto frame = memory_manager->Allocate(1, consumer);
   if(frame.error) {
     return {nullptr, frame.error};
   }
@@ -177,17 +531,113 @@ WithError<PageMapEntry*> NewPageMap() {
 
 Error FreePageMap(PageMapEntry* table) {
   const FrameID frame{reinterpret_cast<uintptr_t>(table) / kBytesPerFrame};
-  return memory_manager->Free(frame, 1);
+  return memory_manager->Free(frame, 1, MemoryConsumer::kPageTable);
 }
 
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) { /* addr means Load Segment header address */
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3()); /* CR3 register stores PML4 (highest) physical address */
-  return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable,
+    MemoryConsumer consumer) { /* addr means Load Segment header address */
+  auto pml4_table = CurrentPML4(); /* CR3 register stores PML4 (highest) physical address */
+  return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable, consumer).error;
 }
 
 Error CleanPageMaps(LinearAddress4Level addr) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-  return CleanPageMap(pml4_table, 4, addr);
+  auto pml4_table = CurrentPML4();
+  auto err = CleanPageMap(pml4_table, 4, addr);
+  /* reloading CR3 without the no-flush bit drops the non-global entries of this PCID only */
+  SetCR3(GetCR3());
+  return err;
+}
+
+Error FreeAppPageMap(PageMapEntry* pml4) {
+  if(auto err = CleanPageMap(pml4, 4, LinearAddress4Level{0xffff'8000'0000'0000})) {
+    return err;
+  }
+  return FreePageMap(pml4);
+}
+
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+  const uint64_t begin = addr.value;
+  const uint64_t end = begin + num_4kpages * kPageSize4K;
+  auto pml4 = CurrentPML4();
+
+  uint64_t a = begin;
+  while(a < end) {
+    int leaf_part;
+    auto entry = FindLeafEntry(pml4, 4, LinearAddress4Level{a}, leaf_part);
+    if(entry == nullptr) {
+      a += kPageSize4K;
+      continue;
+    }
+
+    if(leaf_part == 2) {
+      const uint64_t huge_begin = a & ~(kPageSize2M - 1);
+      if(huge_begin == a && a + kPageSize2M <= end) {
+        if(auto err = ReleaseLeaf(*entry, kFramesPer2M)) return err;
+        a += kPageSize2M;
+        continue;
+      }
+      /* a shared 2 MiB page is counted as a whole, so only an unshared one can be split and freed in part */
+      if(memory_manager->RefCount(FrameOf(*entry)) > 1) {
+        a = std::min(huge_begin + kPageSize2M, end);
+        continue;
+      }
+      if(auto err = SplitHugePage(*entry)) return err;
+      continue;
+    }
+
+    if(auto err = ReleaseLeaf(*entry, 1)) return err;
+    a += kPageSize4K;
+  }
+
+  /* reloading CR3 is cheaper than invalidating many pages one by one */
+  if(num_4kpages > kFaultAroundPages) {
+    SetCR3(GetCR3());
+  } else {
+    for(a = begin; a < end; a += kPageSize4K) {
+      InvalidateTLB(a);
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<size_t> WriteBackFileMapping(const FileMapping& m, uint64_t begin, uint64_t end) {
+  const uint64_t file_end = m.vaddr_begin + m.length;
+  auto pml4 = CurrentPML4();
+  size_t num_written = 0;
+
+  uint64_t addr = begin & ~(kPageSize4K - 1);
+  while(addr < end && addr < file_end) {
+    int leaf_part;
+    auto entry = FindLeafEntry(pml4, 4, LinearAddress4Level{addr}, leaf_part);
+    const uint64_t page_bytes = entry && leaf_part == 2 ? kPageSize2M : kPageSize4K;
+    const uint64_t page = addr & ~(page_bytes - 1);
+    if(entry && entry->bits.dirty) {
+      const uint64_t write_end = std::min(page + page_bytes, file_end);
+      m.fd->Store(reinterpret_cast<const void*>(page), write_end - page, m.file_offset + page - m.vaddr_begin);
+      /* the CPU sets the dirty bit only through a TLB entry which has it clear */
+      entry->bits.dirty = 0;
+      InvalidateTLB(page);
+      num_written++;
+    }
+    addr = page + page_bytes;
+  }
+  task_manager->CurrentTask().CountWriteBack(num_written);
+  return { num_written, MAKE_ERROR(Error::kSuccess) };
+}
+
+size_t CountDirtyPages(PageMapEntry* pml4, const FileMapping& m) {
+  size_t num_dirty = 0;
+  uint64_t addr = m.vaddr_begin;
+  while(addr < m.vaddr_end) {
+    int leaf_part;
+    auto entry = FindLeafEntry(pml4, 4, LinearAddress4Level{addr}, leaf_part);
+    const uint64_t page_bytes = entry && leaf_part == 2 ? kPageSize2M : kPageSize4K;
+    if(entry && entry->bits.dirty) {
+      num_dirty++;
+    }
+    addr = (addr & ~(page_bytes - 1)) + page_bytes;
+  }
+  return num_dirty;
 }
 
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
@@ -196,8 +646,7 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
       if(!src[i].bits.present) {
         continue;
       }
-      dest[i] = src[i];
-      dest[i].bits.writable = 0;
+      ShareLeaf(dest[i], src[i]);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -206,6 +655,10 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
     if(!src[i].bits.present) {
       continue;
     }
+    if(part == 2 && src[i].bits.huge_page) { /* a 2 MiB page is shared like a PT entry */
+      ShareLeaf(dest[i], src[i]);
+      continue;
+    }
 
     auto [ table, err ] = NewPageMap();
     if(err) {
@@ -223,24 +676,69 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
 
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
   auto& task = task_manager->CurrentTask();
+  task.CountPageFault();
   const bool present = (error_code >> 0) & 1;
   const bool rw = (error_code >> 1) & 1;
-  const bool user = (error_code >> 2) & 1;
 
-  if(present && rw && user) {
-    /* page fault due to readonly violation*/
-    return CopyOnePage(causal_addr);
+  if(present && rw) {
+    /* page fault due to readonly violation, by the app or by the kernel writing to app memory */
+    const bool app_range = (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) ||
+      FindFileMapping(task.FileMaps(), causal_addr) != nullptr;
+    return CopyOnePage(causal_addr, app_range);
   } else if(present) {
     return MAKE_ERROR(Error::kAlreadyAllocated);
   }
 
   if(task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
+    if(FitsHugePage(causal_addr, task.DPagingBegin(), task.DPagingEnd()) &&
+       !SetupHugePage(LinearAddress4Level{causal_addr & ~(kPageSize2M - 1)}, MemoryConsumer::kAppPage)) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
     return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
   }
 
   if(auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-    return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+    return PreparePageCache(*m, causal_addr);
   }
 
   return MAKE_ERROR(Error::kIndexOutOfRange);
 }
+
+Error MapKernelPages(uint64_t addr, size_t num_4kpages, MemoryConsumer consumer) {
+  for(size_t i = 0; i < num_4kpages; i++, addr += kPageSize4K) {
+    auto [ entry, err ] = KernelPageEntry(addr, true);
+    if(err) {
+      return err;
+    }
+    auto [ frame, alloc_err ] = memory_manager->Allocate(1, consumer);
+    if(alloc_err) {
+      return alloc_err;
+    }
+    entry->data = 0;
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+    entry->bits.present = 1;
+    entry->bits.writable = 1;
+    entry->bits.global = 1; /* so that InvalidateTLB drops it from every PCID */
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPages(uint64_t addr, size_t num_4kpages, MemoryConsumer consumer) {
+  for(size_t i = 0; i < num_4kpages; i++, addr += kPageSize4K) {
+    auto [ entry, err ] = KernelPageEntry(addr, false);
+    if(err) {
+      return err;
+    }
+    if(entry == nullptr || !entry->bits.present) {
+      continue;
+    }
+    const FrameID frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+    entry->data = 0;
+    /* the kernel heap is mapped on every CPU */
+    ShootdownTLB(addr);
+    if(auto err = memory_manager->Free(frame, 1, consumer)) {
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
@@ -2,6 +2,9 @@
 #include <cstddef>
 #include <cstdint>
 #include "error.hpp"
+#include "memory_manager.hpp"
+
+struct FileMapping;
 
 union LinearAddress4Level {
   uint64_t value;
@@ -50,8 +53,10 @@ union PageMapEntry {
     uint64_t dirty: 1;
     uint64_t huge_page: 1;
     uint64_t global: 1;
-    uint64_t : 3;
-    
+    uint64_t page_cache: 1; /* ignored by CPU. set on leaf pages of file mappings */
+    uint64_t volume: 1; /* ignored by CPU. set on leaf pages which map the FAT volume image itself */
+    uint64_t : 1;
+
     uint64_t addr: 40;
     uint64_t: 12;
   } __attribute__((packed)) bits;
@@ -65,14 +70,45 @@ union PageMapEntry {
   }
 };
 
+/* the 2 MiB page fallback can identity-map up to kPageDirectoryCount GiB */
 const size_t kPageDirectoryCount = 64;
-void SetupIdentityPageTable();
-void InitializePaging();
+void SetupIdentityPageTable(uint64_t end);
+/* maps [0, end) to the same physical addresses, with 1 GiB pages if the CPU supports them */
+Error ExtendIdentityMap(uint64_t end);
+void InitializePaging(const MemoryMap& memory_map);
 void ResetCR3();
 
-WithError<PageMapEntry*> NewPageMap();
+/* CR3 holds the PCID in its low 12 bits when PCID is enabled */
+const uint64_t kCR3PCIDMask = 0xfff;
+/* bit 63 of CR3 if PCID is enabled, which keeps the TLB entries of the loaded PCID */
+extern "C" uint64_t cr3_no_flush;
+inline PageMapEntry* CR3ToPML4(uint64_t cr3) {
+  return reinterpret_cast<PageMapEntry*>(cr3 & ~kCR3PCIDMask);
+}
+PageMapEntry* CurrentPML4();
+/* CR3 value for a new address space, tagged with a PCID of its own */
+WithError<uint64_t> MakeCR3(PageMapEntry* pml4);
+void ReleaseCR3(uint64_t cr3);
+
+WithError<PageMapEntry*> NewPageMap(MemoryConsumer consumer = MemoryConsumer::kPageTable);
 Error FreePageMap(PageMapEntry* table);
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true);
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true,
+    MemoryConsumer consumer = MemoryConsumer::kAppPage);
 Error CleanPageMaps(LinearAddress4Level addr);
+/* releases the app half of a page map which is not loaded in CR3, and the PML4 itself */
+Error FreeAppPageMap(PageMapEntry* pml4);
+/* unmaps the pages of [addr, addr + num_4kpages pages) in the current page map and frees their frames */
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+/* writes the dirty pages of the shared mapping m in [begin, end) back to its file. returns the number of pages written */
+WithError<size_t> WriteBackFileMapping(const FileMapping& m, uint64_t begin, uint64_t end);
+/* the number of dirty pages of the mapping m in the page map pml4, which may be of another task */
+size_t CountDirtyPages(PageMapEntry* pml4, const FileMapping& m);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+/* map/unmap 4 KiB pages in the kernel half of the address space.
+ * The top level entry must have been made before any app PML4 copies it,
+ * after which the mapping is shared by every task.
+ */
+Error MapKernelPages(uint64_t addr, size_t num_4kpages, MemoryConsumer consumer);
+Error UnmapKernelPages(uint64_t addr, size_t num_4kpages, MemoryConsumer consumer);
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstddef>
 #include <array>
+#include <atomic>
 #include "error.hpp"
 
 template <typename T>
@@ -71,3 +72,94 @@ template <typename T>
 const T& ArrayQueue<T>::Front() const {
   return data_[read_pos_];
 }
+
+/* Bounded queue for many producers and a single consumer, without locks.
+ * A producer reserves a cell by advancing the write position with a CAS and then publishes it
+ * by storing its sequence number, so pushes from tasks and interrupt handlers never block.
+ * Each cell carries a sequence number telling whether it is free, published or consumed.
+ * The consumer and UpdateBack() claim a published cell with a CAS before touching its value.
+ * N must be a power of two.
+ */
+template <typename T, size_t N>
+class AtomicArrayQueue {
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+  public:
+    AtomicArrayQueue();
+    Error Push(const T& value);
+    /* lets update modify the newest published value not yet popped. returns what update returns,
+     * or false if there is no such value */
+    template <class F>
+    bool UpdateBack(F update);
+    /* for the consumer only. an empty result may be a cell being updated, which is pushed again soon */
+    Error Pop(T& value);
+    /* for the consumer only. true if no cell has been reserved beyond the popped ones */
+    bool Empty() const { return write_pos_.load(std::memory_order_acquire) == read_pos_; }
+    size_t Capacity() const { return N; }
+  private:
+    static const size_t kBusy = ~static_cast<size_t>(0);
+    struct Cell {
+      std::atomic<size_t> seq;
+      T value;
+    };
+    std::array<Cell, N> cells_;
+    std::atomic<size_t> write_pos_{0};
+    size_t read_pos_{0};
+};
+
+template <typename T, size_t N>
+AtomicArrayQueue<T, N>::AtomicArrayQueue() {
+  for(size_t i = 0; i < N; i++) {
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, size_t N>
+Error AtomicArrayQueue<T, N>::Push(const T& value) {
+  size_t pos = write_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while(true) {
+    cell = &cells_[pos & (N - 1)];
+    const size_t seq = cell->seq.load(std::memory_order_acquire);
+    const auto diff = static_cast<ptrdiff_t>(seq - pos);
+    if(diff == 0) {
+      if(write_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if(diff < 0) { /* the cell of one lap before is not consumed yet, or is being popped */
+      return MAKE_ERROR(Error::kFull);
+    } else {
+      pos = write_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->value = value;
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+template <typename T, size_t N>
+template <class F>
+bool AtomicArrayQueue<T, N>::UpdateBack(F update) {
+  const size_t pos = write_pos_.load(std::memory_order_acquire) - 1;
+  Cell& cell = cells_[pos & (N - 1)];
+  size_t published = pos + 1;
+  if(!cell.seq.compare_exchange_strong(published, kBusy, std::memory_order_acquire)) {
+    return false;
+  }
+  const bool updated = update(cell.value);
+  cell.seq.store(pos + 1, std::memory_order_release);
+  return updated;
+}
+
+template <typename T, size_t N>
+Error AtomicArrayQueue<T, N>::Pop(T& value) {
+  Cell& cell = cells_[read_pos_ & (N - 1)];
+  size_t published = read_pos_ + 1;
+  if(!cell.seq.compare_exchange_strong(published, kBusy, std::memory_order_acquire)) {
+    return MAKE_ERROR(Error::kEmpty);
+  }
+  value = cell.value;
+  cell.seq.store(read_pos_ + N, std::memory_order_release);
+  read_pos_++;
+  return MAKE_ERROR(Error::kSuccess);
+}
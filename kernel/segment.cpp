@@ -4,12 +4,14 @@
 #include "logger.hpp"
 #include "interrupt.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 
 namespace {
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  /* each CPU has a GDT of its own, since its TSS descriptor is marked busy by LoadTR */
+  std::array<std::array<SegmentDescriptor, 7>, kMaxCPUs> gdts;
+  std::array<std::array<uint32_t, 26>, kMaxCPUs> tsses;
 
-  static_assert((kTSS >> 3) + 1 < gdt.size());
+  static_assert((kTSS >> 3) + 1 < gdts[0].size());
 }
 
 
@@ -48,7 +50,8 @@ void SetDataSegment(SegmentDescriptor& desc,
   desc.bits.default_operation_size = 1;
 }
 
-void SetupSegments() {
+void SetupSegments(int cpu) {
+  auto& gdt = gdts[cpu];
   gdt[0].data = 0;
   SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
   SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
@@ -57,19 +60,19 @@ void SetupSegments() {
   LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
 }
 
-void InitializeSegmentation() {
-  SetupSegments();
+void InitializeSegmentation(int cpu) {
+  SetupSegments(cpu);
   SetDSAll(kKernelDS);
   SetCSSS(kKernelCS, kKernelSS);
 }
 
-void SetTSS(int index, uint64_t value) {
+void SetTSS(std::array<uint32_t, 26>& tss, int index, uint64_t value) {
   tss[index] = value & 0xffffffff;
   tss[index + 1] = value >> 32;
 }
 
 uint64_t AllocateStackArea(int num_4kframes) {
-  auto [ stk, err ] = memory_manager->Allocate(num_4kframes);
+  auto [ stk, err ] = memory_manager->Allocate(num_4kframes, MemoryConsumer::kTaskStack);
   if(err) {
     Log(kError, "failed to allocate stack area %s\n", err.Name());
     exit(1);
@@ -77,9 +80,11 @@ uint64_t AllocateStackArea(int num_4kframes) {
   return reinterpret_cast<uint64_t>(stk.Frame()) + num_4kframes * 4096;
 }
 
-void InitializeTSS(){
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISForTimer, AllocateStackArea(8));
+void InitializeTSS(int cpu) {
+  auto& gdt = gdts[cpu];
+  auto& tss = tsses[cpu];
+  SetTSS(tss, 1, AllocateStackArea(8));
+  SetTSS(tss, 7 + 2 * kISForTimer, AllocateStackArea(8));
 
   /* When the interruption in the user mode happens, CPU will refer the GDT entry specified by the TR Register and get the TSS
    * So, GDT entry specifies TSS header address and TSS RSP0 specifies the stack end address.
@@ -38,7 +38,8 @@ const uint16_t kKernelDS = 0;
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kTSS = 5 << 3;
-void SetupSegments();
-void InitializeSegmentation();
-void InitializeTSS();
+/* cpu is the index of the CPU whose GDT and TSS are set up and loaded */
+void SetupSegments(int cpu = 0);
+void InitializeSegmentation(int cpu = 0);
+void InitializeTSS(int cpu = 0);
 void SetSystemSegment(SegmentDescriptor& desc, DescriptorType type, unsigned int descriptor_privilege_level, uint32_t base, uint32_t limit);
@@ -0,0 +1,112 @@
+#include "slab.hpp"
+#include <cstdlib>
+#include "logger.hpp"
+
+namespace {
+  /* caches are linked here on their first allocation, for memstat */
+  SlabCache* cache_list = nullptr;
+  SpinLock cache_list_lock;
+}
+
+void* SlabCache::Allocate() {
+  SpinLockGuard guard{lock_};
+  if(!registered_) {
+    SpinLockGuard list_guard{cache_list_lock};
+    next_ = cache_list;
+    cache_list = this;
+    registered_ = true;
+  }
+
+  Slab* slab = partial_;
+  if(slab) {
+    hits_++;
+  } else {
+    /* without the lock, since the memory manager may reclaim frames freeing objects of this cache */
+    lock_.Unlock();
+    auto [ frame, err ] = memory_manager->Allocate(slab_frames_, MemoryConsumer::kSlab);
+    lock_.Lock();
+    if(err) {
+      Log(kError, "slab: failed to allocate a slab for %s\n", name_);
+      exit(1);
+    }
+    slab = NewSlab(frame);
+    misses_++;
+  }
+
+  void* obj = slab->free_list;
+  slab->free_list = *reinterpret_cast<void**>(obj);
+  slab->in_use++;
+  in_use_++;
+  if(slab->free_list == nullptr) {
+    UnlinkPartial(slab);
+  }
+  return obj;
+}
+
+void SlabCache::Free(void* p) {
+  if(p == nullptr) return;
+  SpinLockGuard guard{lock_};
+
+  auto slab = *reinterpret_cast<Slab**>(reinterpret_cast<uint8_t*>(p) - kChunkHeaderSize);
+  if(slab->free_list == nullptr) {
+    LinkPartial(slab);
+  }
+  *reinterpret_cast<void**>(p) = slab->free_list;
+  slab->free_list = p;
+  slab->in_use--;
+  in_use_--;
+
+  /* keep one empty slab around so that alloc/free pairs don't hit the memory manager */
+  if(slab->in_use == 0 && (partial_ != slab || slab->next != nullptr)) {
+    UnlinkPartial(slab);
+    num_slabs_--;
+    const FrameID frame{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame};
+    memory_manager->Free(frame, slab_frames_, MemoryConsumer::kSlab);
+  }
+}
+
+SlabCache::Slab* SlabCache::NewSlab(FrameID frame) {
+  auto slab = reinterpret_cast<Slab*>(frame.Frame());
+  slab->next = slab->prev = nullptr;
+  slab->free_list = nullptr;
+  slab->in_use = 0;
+
+  /* build the free list backwards so that chunks are handed out in address order */
+  auto chunks = reinterpret_cast<uint8_t*>(slab) + kSlabHeaderSize;
+  for(size_t i = objects_per_slab_; i > 0; i--) {
+    uint8_t* chunk = chunks + (i - 1) * chunk_size_;
+    *reinterpret_cast<Slab**>(chunk) = slab;
+    void* obj = chunk + kChunkHeaderSize;
+    *reinterpret_cast<void**>(obj) = slab->free_list;
+    slab->free_list = obj;
+  }
+
+  num_slabs_++;
+  LinkPartial(slab);
+  return slab;
+}
+
+void SlabCache::LinkPartial(Slab* slab) {
+  slab->prev = nullptr;
+  slab->next = partial_;
+  if(partial_) {
+    partial_->prev = slab;
+  }
+  partial_ = slab;
+}
+
+void SlabCache::UnlinkPartial(Slab* slab) {
+  if(slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    partial_ = slab->next;
+  }
+  if(slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = slab->prev = nullptr;
+}
+
+const SlabCache* SlabCacheList() {
+  return cache_list;
+}
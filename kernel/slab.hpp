@@ -0,0 +1,98 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+/* Object cache for fixed-size kernel objects.
+ * Each slab is a run of frames from the memory manager, cut into chunks of the same size.
+ * A chunk starts with a pointer to its slab, so Free() finds the slab in O(1).
+ * The constructor is constexpr, so a SlabCache can be a global without a runtime constructor.
+ * Running out of frames is fatal, so Allocate() never returns nullptr.
+ * Allocate() and Free() may be called on any CPU and in interrupt handlers.
+ */
+class SlabCache {
+  public:
+    static const size_t kMinObjectsPerSlab = 8;
+
+    constexpr SlabCache(const char* name, size_t object_size)
+      : name_{name}, object_size_{object_size},
+        chunk_size_{kChunkHeaderSize + ((object_size + kAlign - 1) & ~(kAlign - 1))},
+        slab_frames_{(kSlabHeaderSize + kMinObjectsPerSlab * chunk_size_ + kBytesPerFrame - 1) / kBytesPerFrame},
+        objects_per_slab_{(slab_frames_ * kBytesPerFrame - kSlabHeaderSize) / chunk_size_} {
+    }
+
+    void* Allocate();
+    void Free(void* p);
+
+    const char* Name() const { return name_; }
+    size_t ObjectSize() const { return object_size_; }
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+    size_t InUse() const { return in_use_; }
+    size_t Capacity() const { return num_slabs_ * objects_per_slab_; }
+    const SlabCache* Next() const { return next_; }
+  private:
+    struct Slab {
+      Slab* next;
+      Slab* prev;
+      void* free_list;
+      size_t in_use;
+    };
+
+    static const size_t kAlign = 16;
+    static const size_t kChunkHeaderSize = kAlign;
+    static const size_t kSlabHeaderSize = (sizeof(Slab) + kAlign - 1) & ~(kAlign - 1);
+
+    const char* name_;
+    size_t object_size_, chunk_size_;
+    size_t slab_frames_, objects_per_slab_;
+    Slab* partial_{nullptr}; /* slabs which have at least one free chunk */
+    size_t num_slabs_{0};
+    size_t hits_{0}, misses_{0}, in_use_{0};
+    bool registered_{false};
+    SlabCache* next_{nullptr};
+    SpinLock lock_;
+
+    Slab* NewSlab(FrameID frame);
+    void LinkPartial(Slab* slab);
+    void UnlinkPartial(Slab* slab);
+};
+
+const SlabCache* SlabCacheList();
+
+/* Allocator for standard containers. Single objects come from the given cache
+ * if they fit in it, and the others from the kernel heap.
+ */
+template <class T>
+class SlabAllocator {
+  public:
+    using value_type = T;
+
+    explicit SlabAllocator(SlabCache& cache) noexcept : cache_{&cache} {}
+    template <class U> SlabAllocator(const SlabAllocator<U>& other) noexcept : cache_{other.cache_} {}
+
+    T* allocate(size_t n) {
+      if(n == 1 && sizeof(T) <= cache_->ObjectSize()) {
+        return static_cast<T*>(cache_->Allocate());
+      }
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+      if(n == 1 && sizeof(T) <= cache_->ObjectSize()) {
+        cache_->Free(p);
+        return;
+      }
+      ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U>& rhs) const { return cache_ == rhs.cache_; }
+    template <class U>
+    bool operator!=(const SlabAllocator<U>& rhs) const { return cache_ != rhs.cache_; }
+  private:
+    SlabCache* cache_;
+    template <class U> friend class SlabAllocator;
+};
@@ -0,0 +1,248 @@
+#include "smp.hpp"
+
+#include <array>
+#include <cstring>
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "boot_option.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "msr.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "spinlock.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern "C" {
+  /* apboot.asm */
+  extern uint8_t APBootStart[], APBootParams[], APBootEnd[];
+}
+
+namespace {
+  volatile uint32_t& lapic_id_reg = *reinterpret_cast<uint32_t*>(0xfee00020);
+  volatile uint32_t& spurious_reg = *reinterpret_cast<uint32_t*>(0xfee000f0);
+  volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+  volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+  const uint32_t kICRInit = 0b101 << 8;
+  const uint32_t kICRStartup = 0b110 << 8;
+  const uint32_t kICRDeliveryPending = 1 << 12;
+  const uint32_t kICRAssert = 1 << 14;
+  const uint32_t kICRAllExcludingSelf = 0b11 << 18;
+
+  /* the layout of APBootParams in apboot.asm */
+  struct APBootParamBlock {
+    uint64_t cr3, cr4, cr0, stack, entry, cpu;
+  } __attribute__((packed));
+
+  std::array<CPU, kMaxCPUs> cpus;
+  bool boot_cpu_initialized = false;
+  std::atomic<int> num_cpus{1};
+
+  SpinLock shootdown_lock;
+  uint64_t shootdown_addr;
+  std::atomic<int> shootdown_pending{0};
+
+  void SendIPI(uint32_t lapic_id, uint32_t command) {
+    /* the ICR is written in two steps, which an interrupt handler sending one must not split */
+    InterruptGuard guard;
+    icr_high = lapic_id << 24;
+    icr_low = command;
+    while(icr_low & kICRDeliveryPending) {
+      __builtin_ia32_pause();
+    }
+  }
+
+  uint32_t LAPICID() {
+    return lapic_id_reg >> 24;
+  }
+
+  void SetupCPU(CPU& cpu, int index, uint32_t lapic_id) {
+    cpu.self = &cpu;
+    cpu.index = index;
+    cpu.lapic_id = lapic_id;
+    cpu.cr3_flags = cr3_no_flush;
+  }
+
+  /* called by apboot.asm on the stack given in APBootParams */
+  void APMain(CPU* cpu) {
+    InitializeSegmentation(cpu->index);
+    /* after SetDSAll, since loading GS may clear its base */
+    WriteMSR(kIA32_GS_BASE, reinterpret_cast<uint64_t>(cpu));
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+
+    /* the BSP waits for us doing nothing else, so we may use the kernel on behalf of it */
+    InitializeTSS(cpu->index);
+    InitializeSyscall();
+    spurious_reg = spurious_reg | 0x100; /* APIC software enable */
+    task_manager->InitializeCPU();
+    StartLocalTimerInterrupt();
+
+    num_cpus.fetch_add(1, std::memory_order_release);
+    cpu->started.store(true, std::memory_order_release);
+
+    task_manager->Idle();
+  }
+
+  bool StartAP(CPU& cpu, APBootParamBlock& params) {
+    auto [ stack, err ] = memory_manager->Allocate(
+        Task::kDefaultStackBytes / kBytesPerFrame, MemoryConsumer::kTaskStack);
+    if(err) {
+      Log(kError, "failed to allocate a stack for CPU %d: %s\n", cpu.index, err.Name());
+      return false;
+    }
+    params.stack = reinterpret_cast<uint64_t>(stack.Frame()) + Task::kDefaultStackBytes;
+    params.cpu = reinterpret_cast<uint64_t>(&cpu);
+
+    /* INIT, and then SIPI twice as the MultiProcessor Specification tells */
+    SendIPI(cpu.lapic_id, kICRInit | kICRAssert);
+    acpi::WaitMilliseconds(10);
+    for(int i = 0; i < 2 && !cpu.started.load(std::memory_order_acquire); i++) {
+      SendIPI(cpu.lapic_id, kICRStartup | kICRAssert | (kAPBootAddress >> 12));
+      acpi::WaitMilliseconds(1);
+    }
+
+    for(int ms = 0; ms < 100; ms++) {
+      if(cpu.started.load(std::memory_order_acquire)) {
+        return true;
+      }
+      acpi::WaitMilliseconds(1);
+    }
+    Log(kWarn, "CPU %d (LAPIC ID %u) didn't start\n", cpu.index, cpu.lapic_id);
+    memory_manager->Free(stack, Task::kDefaultStackBytes / kBytesPerFrame, MemoryConsumer::kTaskStack);
+    return false;
+  }
+}
+
+int CurrentCPUIndex() {
+  return boot_cpu_initialized ? CurrentCPU().index : 0;
+}
+
+bool InInterruptHandler() {
+  return boot_cpu_initialized && CurrentCPU().interrupt_depth > 0;
+}
+
+int NumCPUs() {
+  return num_cpus.load(std::memory_order_acquire);
+}
+
+CPU& CPUAt(int index) {
+  return cpus[index];
+}
+
+void InitializeBootCPU() {
+  SetupCPU(cpus[0], 0, LAPICID());
+  WriteMSR(kIA32_GS_BASE, reinterpret_cast<uint64_t>(&cpus[0]));
+  boot_cpu_initialized = true;
+}
+
+void StartApplicationProcessors() {
+  if(BootOptionIs("smp", "off") || acpi::madt == nullptr) {
+    Log(kInfo, "SMP: disabled\n");
+    return;
+  }
+
+  std::array<uint32_t, kMaxCPUs * 2> lapic_ids;
+  const size_t num_ids = acpi::madt->ProcessorLAPICIDs(lapic_ids.data(), lapic_ids.size());
+
+  memcpy(reinterpret_cast<void*>(kAPBootAddress), APBootStart, APBootEnd - APBootStart);
+  auto& params = *reinterpret_cast<APBootParamBlock*>(kAPBootAddress + (APBootParams - APBootStart));
+  params.cr3 = GetCR3() & ~kCR3PCIDMask;
+  params.cr4 = GetCR4();
+  params.cr0 = GetCR0();
+  params.entry = reinterpret_cast<uint64_t>(APMain);
+
+  int index = 1;
+  for(size_t i = 0; i < num_ids && index < kMaxCPUs; i++) {
+    if(lapic_ids[i] == cpus[0].lapic_id) {
+      continue;
+    }
+    SetupCPU(cpus[index], index, lapic_ids[i]);
+    if(StartAP(cpus[index], params)) {
+      index++;
+    }
+  }
+  Log(kInfo, "SMP: %d CPUs\n", NumCPUs());
+}
+
+void ShootdownTLB(uint64_t addr) {
+  InvalidateTLB(addr);
+  if(NumCPUs() == 1) {
+    return;
+  }
+
+  SpinLockGuard guard{shootdown_lock};
+  const int self = CurrentCPU().index;
+  shootdown_addr = addr;
+  shootdown_pending.store(NumCPUs() - 1, std::memory_order_relaxed);
+  for(int i = 0; i < NumCPUs(); i++) {
+    if(i != self) {
+      cpus[i].tlb_shootdown.store(true, std::memory_order_release);
+    }
+  }
+  SendIPI(0, kICRAllExcludingSelf | kICRAssert | InterruptVector::kTLBShootdown);
+
+  /* the others answer in the interrupt, or in CPURelax if they are spinning with interrupts disabled */
+  while(shootdown_pending.load(std::memory_order_acquire) > 0) {
+    __builtin_ia32_pause();
+  }
+}
+
+void InterruptCPU(int index, int vector) {
+  SendIPI(cpus[index].lapic_id, kICRAssert | vector);
+}
+
+void WakeCPU(int index) {
+  InterruptCPU(index, InterruptVector::kWakeup);
+}
+
+void CPURelax() {
+  __builtin_ia32_pause();
+  if(NumCPUs() == 1) {
+    return;
+  }
+  CPU& cpu = CurrentCPU();
+  if(cpu.tlb_shootdown.exchange(false, std::memory_order_acquire)) {
+    InvalidateTLB(shootdown_addr);
+    shootdown_pending.fetch_sub(1, std::memory_order_release);
+  }
+}
+
+namespace {
+  /* the lock of newlib's malloc, which is recursive. -1 if no CPU holds it */
+  SpinLock malloc_lock;
+  std::atomic<int> malloc_owner{-1};
+  int malloc_depth = 0;
+  uint64_t malloc_rflags;
+}
+
+struct _reent;
+
+/* newlib calls these around malloc and free. interrupts are disabled meanwhile,
+ * so that an interrupt handler doesn't find the heap half updated on this CPU */
+extern "C" void __malloc_lock(struct _reent*) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) : : "memory");
+  const int self = CurrentCPUIndex();
+  if(malloc_owner.load(std::memory_order_relaxed) != self) {
+    malloc_lock.Lock();
+    malloc_owner.store(self, std::memory_order_relaxed);
+    malloc_rflags = rflags;
+  }
+  malloc_depth++;
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+  if(--malloc_depth > 0) {
+    return;
+  }
+  const uint64_t rflags = malloc_rflags;
+  malloc_owner.store(-1, std::memory_order_relaxed);
+  malloc_lock.Unlock();
+  if(rflags & (1u << 9)) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
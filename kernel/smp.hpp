@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class Task;
+
+const int kMaxCPUs = 16;
+/* the startup code of application processors is copied to this frame below 1 MiB */
+const uintptr_t kAPBootAddress = 0x8000;
+
+/* Per-CPU data. The GS base of each CPU points at its own, and the kernel never reloads GS.
+ * RestoreContext reads cr3_flags through GS, so keep it at offset 8.
+ */
+struct CPU {
+  CPU* self{nullptr};
+  /* OR-ed to CR3 when a task is resumed. 0 drops the TLB entries of a task moved from another CPU */
+  uint64_t cr3_flags{0};
+  int index{0};
+  uint32_t lapic_id{0};
+  Task* current_task{nullptr};
+  Task* idle_task{nullptr};
+  /* when the time slice of the current task ends, in NowNanoseconds */
+  uint64_t slice_end{0};
+  std::atomic<bool> started{false};
+  std::atomic<bool> tlb_shootdown{false};
+  /* how many hardware interrupt handlers run on this CPU. exception handlers such as #PF are not counted */
+  int interrupt_depth{0};
+};
+
+static_assert(offsetof(CPU, cr3_flags) == 8);
+
+inline CPU& CurrentCPU() {
+  CPU* cpu;
+  __asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+  return *cpu;
+}
+
+/* usable before the GS base is set up, when only the bootstrap processor runs */
+int CurrentCPUIndex();
+/* true while a hardware interrupt handler runs on this CPU. usable before the GS base is set up */
+bool InInterruptHandler();
+
+/* counts a hardware interrupt handler in interrupt_depth while alive.
+ * a handler must leave it before switching tasks, since it does not come back to its frame then */
+class InterruptHandlerScope {
+  public:
+    InterruptHandlerScope() : cpu_{CurrentCPU()} { cpu_.interrupt_depth++; }
+    ~InterruptHandlerScope() { cpu_.interrupt_depth--; }
+    InterruptHandlerScope(const InterruptHandlerScope&) = delete;
+    InterruptHandlerScope& operator=(const InterruptHandlerScope&) = delete;
+
+  private:
+    CPU& cpu_;
+};
+int NumCPUs();
+CPU& CPUAt(int index);
+
+/* sets up the per-CPU data of the bootstrap processor */
+void InitializeBootCPU();
+/* starts the application processors listed in the MADT, unless "smp=off" */
+void StartApplicationProcessors();
+
+/* drops a kernel page from the TLB of every CPU */
+void ShootdownTLB(uint64_t addr);
+/* sends an interrupt of the vector to a CPU */
+void InterruptCPU(int index, int vector);
+/* interrupts a CPU halted in its idle task, so that it looks at its run queue */
+void WakeCPU(int index);
+/* body of a busy wait. it answers TLB shootdowns, since it may spin with interrupts disabled */
+void CPURelax();
@@ -0,0 +1,43 @@
+#pragma once
+#include <atomic>
+#include "interrupt.hpp"
+#include "smp.hpp"
+
+/* Lock for data shared between CPUs. It doesn't disable interrupts by itself,
+ * so data also touched by interrupt handlers must be locked with SpinLockGuard.
+ * The constructor is constexpr, so a SpinLock can be a global without a runtime constructor.
+ */
+class SpinLock {
+  public:
+    constexpr SpinLock() = default;
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    void Lock() {
+      while(locked_.exchange(true, std::memory_order_acquire)) {
+        while(locked_.load(std::memory_order_relaxed)) {
+          CPURelax();
+        }
+      }
+    }
+    bool TryLock() {
+      return !locked_.load(std::memory_order_relaxed) &&
+        !locked_.exchange(true, std::memory_order_acquire);
+    }
+    void Unlock() { locked_.store(false, std::memory_order_release); }
+    bool IsLocked() const { return locked_.load(std::memory_order_relaxed); }
+  private:
+    std::atomic<bool> locked_{false};
+};
+
+/* holds a lock with interrupts disabled on this CPU, and then restores the interrupt flag */
+class SpinLockGuard {
+  public:
+    explicit SpinLockGuard(SpinLock& lock) : lock_{lock} { lock_.Lock(); }
+    ~SpinLockGuard() { lock_.Unlock(); }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+  private:
+    InterruptGuard interrupt_guard_;
+    SpinLock& lock_;
+};
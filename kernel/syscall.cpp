@@ -1,5 +1,6 @@
 
 #include "app_event.hpp"
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cerrno>
@@ -44,9 +45,7 @@ namespace syscall {
       return { 0, E2BIG };
     }
 
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     if(fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
       return { 0, EBADF };
@@ -55,9 +54,7 @@ namespace syscall {
   }
 
   SYSCALL(Exit) {
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
     return { task.OSStackPointer(), static_cast<int>(arg1) };
   }
 
@@ -67,7 +64,7 @@ namespace syscall {
     const auto win = std::make_shared<ToplevelWindow>(
         w, h, screen_config.pixel_format, title
         );
-    __asm__("cli");
+    SpinLockGuard guard{layer_lock};
     const auto layer_id = layer_manager->NewLayer()
       .SetWindow(win) .SetDraggable(true) .Move({x, y})
       .ID();
@@ -75,7 +72,6 @@ namespace syscall {
 
     const auto task_id = task_manager->CurrentTask().ID();
     layer_task_map->insert(std::make_pair(layer_id, task_id));
-    __asm__("sti");
 
     return { layer_id, 0 };
   }
@@ -86,9 +82,11 @@ namespace syscall {
       const uint32_t layer_flags = layer_id_flags >> 32;
       const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-      __asm__("cli");
-      auto layer = layer_manager->FindLayer(layer_id);
-      __asm__("sti");
+      Layer* layer;
+      {
+        SpinLockGuard guard{layer_lock};
+        layer = layer_manager->FindLayer(layer_id);
+      }
 
       if(layer == nullptr) {
         return {0, EBADF};
@@ -100,9 +98,8 @@ namespace syscall {
       }
 
       if((layer_flags & 1) == 0) {
-        __asm__("cli");
+        SpinLockGuard guard{layer_lock};
         layer_manager->Draw(layer_id);
-        __asm__("sti");
       }
 
       return res;
@@ -204,9 +201,7 @@ namespace syscall {
     const auto app_events = reinterpret_cast<AppEvent*>(arg1);
     const size_t len = arg2;
 
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
     size_t i = 0;
 
     while(i < len) {
@@ -279,21 +274,41 @@ namespace syscall {
       return {0, EINVAL};
     }
 
-    __asm__("cli");
     const uint64_t task_id = task_manager->CurrentTask().ID();
-    __asm__("sti");
 
     unsigned long timeout = arg3 * kTimerFreq / 1000;
     if(mode & 1) {
       timeout += timer_manager->CurrentTick();
     }
 
-    __asm__("cli");
     timer_manager->AddTimer(Timer{timeout, -time_value, task_id});
-    __asm__("sti");
     return { timeout * 1000 / kTimerFreq, 0 };
   }
 
+  SYSCALL(GetCurrentTimeNs) {
+    return { NowNanoseconds(), 0 };
+  }
+
+  /* CreateTimer in nanoseconds. the timeout of the event is the deadline in GetCurrentTimeNs */
+  SYSCALL(CreateTimerNs) {
+    const unsigned int mode = arg1;
+    const int time_value = arg2;
+
+    if(time_value <= 0) {
+      return {0, EINVAL};
+    }
+
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+
+    uint64_t deadline = arg3;
+    if(mode & 1) {
+      deadline += NowNanoseconds();
+    }
+
+    timer_manager->AddTimer(Timer::AtNanoseconds(deadline, -time_value, task_id));
+    return { deadline, 0 };
+  }
+
   namespace {
     size_t AllocateFD(Task& task) {
       const size_t num_files = task.Files().size();
@@ -320,9 +335,7 @@ namespace syscall {
   SYSCALL(OpenFile) {
     const char* path = reinterpret_cast<const char*>(arg1);
     const int flags = arg2;
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     if(strcmp(path, "@stdin") == 0) {
       return {0, 0};
@@ -343,7 +356,7 @@ namespace syscall {
     }
 
     size_t fd = AllocateFD(task);
-    task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+    task.Files()[fd] = MakeFileDescriptor<fat::FileDescriptor>(*file);
     return {fd, 0};
   }
 
@@ -351,9 +364,7 @@ namespace syscall {
     const int fd = arg1;
     void* buf = reinterpret_cast<void*>(arg2);
     size_t count = arg3;
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     if(fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
       return {0, EBADF};
@@ -364,9 +375,7 @@ namespace syscall {
   SYSCALL(DemandPages) {
     const size_t num_pages = arg1;
     // const int flags = arg2;
-    __asm__("cli");
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     const uint64_t dp_end = task.DPagingEnd();
     task.SetDPagingEnd(dp_end + 4096 * num_pages);
@@ -376,28 +385,95 @@ namespace syscall {
   SYSCALL(MapFile) {
     const int fd = arg1;
     size_t* file_size = reinterpret_cast<size_t*>(arg2);
-    // const int flags = arg3;
-    __asm__("cli");
+    const int flags = arg3;
     auto& task = task_manager->CurrentTask();
-    __asm__("sti");
 
     if(fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
       return { 0, EBADF };
     }
 
-    *file_size = task.Files()[fd]->Size();
+    /* a shared mapping may be longer than the file, which is extended when it is written back */
+    const bool shared = flags & 1; /* MAP_FILE_SHARED */
+    if(shared) {
+      *file_size = std::max(*file_size, task.Files()[fd]->Size());
+    } else {
+      *file_size = task.Files()[fd]->Size();
+    }
     const uint64_t vaddr_end = task.FileMapEnd();
     const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
     task.SetFileMapEnd(vaddr_begin);
-    task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+    task.FileMaps().push_back(FileMapping{task.Files()[fd], vaddr_begin, vaddr_end, 0, *file_size, shared});
     return { vaddr_begin, 0 };
   }
+
+  SYSCALL(GetPageFaults) {
+    auto& task = task_manager->CurrentTask();
+    return { task.PageFaults(), 0 };
+  }
+
+  SYSCALL(UnmapPages) {
+    const uint64_t addr = arg1;
+    const size_t num_pages = arg2;
+    auto& task = task_manager->CurrentTask();
+
+    const uint64_t end = addr + 4096 * num_pages;
+    if(addr % 4096 != 0 || end < addr) {
+      return { 0, EINVAL };
+    }
+
+    /* the range must lie in the demand paging region or in one file mapping */
+    auto& fmaps = task.FileMaps();
+    auto fmap = std::find_if(fmaps.begin(), fmaps.end(), [&](const FileMapping& m) {
+      return m.vaddr_begin <= addr && end <= m.vaddr_end;
+    });
+    const bool in_dpaging = task.DPagingBegin() <= addr && end <= task.DPagingEnd();
+    if(!in_dpaging && fmap == fmaps.end()) {
+      return { 0, EINVAL };
+    }
+
+    if(fmap != fmaps.end() && fmap->shared) {
+      WriteBackFileMapping(*fmap, addr, end);
+    }
+    if(auto err = UnmapPages(LinearAddress4Level{addr}, num_pages)) {
+      return { 0, ENOMEM };
+    }
+
+    /* unmapping a whole file mapping removes it. the region is reused if it is the lowest one */
+    if(fmap != fmaps.end() && fmap->vaddr_begin == addr && fmap->vaddr_end == end) {
+      if(task.FileMapEnd() == fmap->vaddr_begin) {
+        task.SetFileMapEnd(fmap->vaddr_end);
+      }
+      fmaps.erase(fmap);
+    }
+    return { 0, 0 };
+  }
+
+  SYSCALL(SyncMapping) {
+    const uint64_t addr = arg1;
+    const size_t len = arg2;
+    const uint64_t end = addr + len;
+    if(end < addr) {
+      return { 0, EINVAL };
+    }
+    auto& task = task_manager->CurrentTask();
+
+    for(const FileMapping& m : task.FileMaps()) {
+      if(m.vaddr_begin <= addr && end <= m.vaddr_end) {
+        if(!m.shared) {
+          return { 0, EINVAL };
+        }
+        auto [ num_written, err ] = WriteBackFileMapping(m, addr, end);
+        return { num_written, 0 };
+      }
+    }
+    return { 0, EINVAL };
+  }
 #undef SYSCALL
 }
 
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table {
+extern "C" std::array<SyscallFuncType*, 0x15> syscall_table {
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -414,6 +490,11 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table {
     /* 0x0d */ syscall::ReadFile,
     /* 0x0e */ syscall::DemandPages,
     /* 0x0f */ syscall::MapFile,
+    /* 0x10 */ syscall::GetPageFaults,
+    /* 0x11 */ syscall::UnmapPages,
+    /* 0x12 */ syscall::SyncMapping,
+    /* 0x13 */ syscall::GetCurrentTimeNs,
+    /* 0x14 */ syscall::CreateTimerNs,
 };
 
 void InitializeSyscall() {
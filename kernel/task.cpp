@@ -3,6 +3,9 @@
 #include "timer.hpp"
 #include "segment.hpp"
 #include "error.hpp"
+#include "logger.hpp"
+#include "interrupt.hpp"
+#include "paging.hpp"
 
 namespace {
   template <class T, class U>
@@ -11,20 +14,79 @@ namespace {
     c.erase(it, c.end());
   }
 
-  void TaskIdle(uint64_t task_id, int64_t data) {
-    while(true) {
-      __asm__("hlt");
+  SlabCache task_cache{"task", sizeof(Task)};
+  /* a list node is a message and two links */
+  SlabCache message_cache{"message", sizeof(Message) + 2 * sizeof(void*)};
+
+  /* merges msg into last if it only updates last, e.g. a newer mouse position */
+  bool Coalesce(Message& last, const Message& msg) {
+    if(last.type != msg.type) {
+      return false;
+    }
+    switch(msg.type) {
+      case Message::kInterruptXHCI: /* one notification is enough to process all the events */
+        return true;
+      case Message::kLayer: {
+        auto& l = last.arg.layer;
+        const auto& m = msg.arg.layer;
+        if(last.src_task != msg.src_task || l.op != LayerOperation::DrawArea ||
+            m.op != LayerOperation::DrawArea || l.layer_id != m.layer_id) {
+          return false;
+        }
+        /* one redraw of the bounding box of both areas */
+        const int right = std::max(l.x + l.w, m.x + m.w);
+        const int bottom = std::max(l.y + l.h, m.y + m.h);
+        l.x = std::min(l.x, m.x);
+        l.y = std::min(l.y, m.y);
+        l.w = right - l.x;
+        l.h = bottom - l.y;
+        return true;
+      }
+      case Message::kMouseMove:
+        if(last.src_task != msg.src_task || last.arg.mouse_move.buttons != msg.arg.mouse_move.buttons) {
+          return false;
+        }
+        last.arg.mouse_move.x = msg.arg.mouse_move.x;
+        last.arg.mouse_move.y = msg.arg.mouse_move.y;
+        last.arg.mouse_move.dx += msg.arg.mouse_move.dx;
+        last.arg.mouse_move.dy += msg.arg.mouse_move.dy;
+        return true;
+      default:
+        return false;
     }
   }
+
+  void TaskIdle(uint64_t task_id, int64_t data) {
+    task_manager->Idle();
+  }
 }
 
-Task::Task(uint64_t id): id_{id}, msgs_{} {
+Task::Task(uint64_t id): id_{id}, spilled_{SlabAllocator<Message>{message_cache}} {
+}
+
+Task::~Task() {
+  if(stack_frame_.ID() != kNullFrame.ID()) {
+    memory_manager->Free(stack_frame_, kDefaultStackBytes / kBytesPerFrame, MemoryConsumer::kTaskStack);
+  }
+}
+
+void* Task::operator new(size_t size) {
+  return task_cache.Allocate();
+}
+
+void Task::operator delete(void* p) noexcept {
+  task_cache.Free(p);
 }
 
 Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+  auto [ stack_frame, err ] = memory_manager->Allocate(
+      kDefaultStackBytes / kBytesPerFrame, MemoryConsumer::kTaskStack);
+  if(err) {
+    Log(kError, "failed to allocate task stack: %s\n", err.Name());
+    exit(1);
+  }
+  stack_frame_ = stack_frame;
+  uint64_t stack_end = reinterpret_cast<uint64_t>(stack_frame_.Frame()) + kDefaultStackBytes;
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
@@ -63,14 +125,59 @@ Task& Task::Wakeup() {
 }
 
 void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
-  Wakeup();
+  EnqueueMessage(msg);
+  task_manager->Wakeup(this);
+}
+
+void Task::EnqueueMessage(const Message& msg) {
+  const bool coalesce = overflow_policy_ == OverflowPolicy::kCoalesce;
+  /* the fast path takes no lock and allocates nothing */
+  if(num_spilled_.load(std::memory_order_acquire) != 0) {
+    OverflowMessage(msg);
+  } else if(coalesce && msgs_.UpdateBack([&msg](Message& last) { return Coalesce(last, msg); })) {
+    coalesced_msgs_.fetch_add(1, std::memory_order_relaxed);
+  } else if(msgs_.Push(msg)) {
+    OverflowMessage(msg);
+  }
+}
+
+void Task::OverflowMessage(const Message& msg) {
+  /* kCoalesce has failed to merge it already. only kGrow allocates, so that
+   * a send from an interrupt handler to the other tasks never does */
+  if(overflow_policy_ != OverflowPolicy::kGrow) {
+    dropped_msgs_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  SpinLockGuard guard{spill_lock_};
+  if(num_spilled_.load(std::memory_order_relaxed) == 0 && !msgs_.Push(msg)) {
+    return; /* the receiver has made room meanwhile */
+  }
+  spilled_.push_back(msg);
+  num_spilled_.fetch_add(1, std::memory_order_release);
+  spilled_msgs_.fetch_add(1, std::memory_order_relaxed);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-  if(msgs_.empty()) return std::nullopt;
-  auto m = msgs_.front();
-  msgs_.pop_front();
+  Message m;
+  if(!msgs_.Pop(m)) {
+    delivered_msgs_++;
+    return m;
+  }
+  /* a producer has reserved the next cell but not published it yet, or is coalescing into it.
+   * its message is older than the spilled ones, and the producer wakes this task after publishing */
+  if(!msgs_.Empty()) {
+    return std::nullopt;
+  }
+  if(num_spilled_.load(std::memory_order_acquire) == 0) {
+    return std::nullopt;
+  }
+
+  SpinLockGuard guard{spill_lock_};
+  m = spilled_.front();
+  spilled_.pop_front();
+  num_spilled_.fetch_sub(1, std::memory_order_release);
+  delivered_msgs_++;
   return m;
 }
 
@@ -107,190 +214,458 @@ std::vector<FileMapping>& Task::FileMaps() {
 }
 
 TaskManager::TaskManager() {
-  Task& task = NewTask()
-    .SetLevel(current_level_)
+  CPU& cpu = CurrentCPU();
+  /* the task table is empty at boot, and so are the first tasks of each CPU sure to fit */
+  Task& task = NewTask().value
+    ->SetLevel(kMaxLevel)
     .SetRunning(true);
-  running_[current_level_].push_back(&task);
-
-  Task& idle = NewTask()
-    .InitContext(TaskIdle, 0)
+  main_task_ = &task;
+  task.cpu_ = task.last_cpu_ = cpu.index;
+  task.rq_ = cpu.index;
+  task.on_cpu_ = true;
+  cpu.current_task = &task;
+  /* the main task runs in the kernel from the start */
+  kernel_lock_.Lock();
+
+  Task& idle = NewTask().value
+    ->InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  idle.kernel_locked_ = false;
+  idle.rq_ = cpu.index;
+  cpu.idle_task = &idle;
 }
 
-Task& TaskManager::NewTask() {
-  latest_id_++;
-  return *tasks_.emplace_back(new Task{latest_id_});
+void TaskManager::InitializeCPU() {
+  CPU& cpu = CurrentCPU();
+  Task& idle = NewTask().value
+    ->SetLevel(0)
+    .SetRunning(true);
+  idle.kernel_locked_ = false;
+  idle.cpu_ = idle.last_cpu_ = cpu.index;
+  idle.rq_ = cpu.index;
+  idle.on_cpu_ = true;
+  cpu.idle_task = cpu.current_task = &idle;
+}
+
+WithError<Task*> TaskManager::NewTask() {
+  SpinLockGuard guard{lock_};
+  size_t tries = 0;
+  do {
+    latest_id_++;
+    if(++tries > kMaxTasks) {
+      return { nullptr, MAKE_ERROR(Error::kFull) };
+    }
+  } while(tasks_[latest_id_ & (kMaxTasks - 1)]);
+
+  auto& slot = tasks_[latest_id_ & (kMaxTasks - 1)];
+  slot.reset(new Task{latest_id_});
+
+  /* a new task has no CPU to go back to, so it starts on the least busy one */
+  auto load = [this](int i) {
+    return run_queues_[i].num_ready.load(std::memory_order_relaxed) + (IsIdle(i) ? 0 : 1);
+  };
+  int rq = CurrentCPUIndex();
+  for(int i = 0; i < NumCPUs(); i++) {
+    if(load(i) < load(rq)) {
+      rq = i;
+    }
+  }
+  slot->rq_.store(rq, std::memory_order_relaxed);
+  return { slot.get(), MAKE_ERROR(Error::kSuccess) };
+}
+
+Task* TaskManager::FindTask(uint64_t id) {
+  /* most messages go to the main task */
+  if(id == kMainTaskID) {
+    return main_task_;
+  }
+  Task* task = tasks_[id & (kMaxTasks - 1)].get();
+  if(task == nullptr || task->ID() != id) {
+    return nullptr;
+  }
+  return task;
 }
 
 void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-  TaskContext& task_ctx = task_manager->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-  Task* current_task = RotateCurrentRunQueue(false);
+  CPU& cpu = CurrentCPU();
+  Task* current = cpu.current_task;
+  RunQueue& rq = run_queues_[cpu.index];
+
+  rq.lock.Lock();
+  /* a task keeps the CPU unless one of the same or a higher level is ready */
+  const bool runnable = current != cpu.idle_task && current->Running();
+  Task* next = PopReady(rq, runnable ? current->Level() : 0);
+  if(next == nullptr && !runnable) {
+    next = Steal(cpu);
+  }
+  if(next == nullptr) {
+    next = runnable ? current : cpu.idle_task;
+  }
+  if(next == current) {
+    rq.lock.Unlock();
+    StartTimeSlice(current == cpu.idle_task);
+    return;
+  }
 
-  if(&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+  memcpy(&current->Context(), &current_ctx, sizeof(TaskContext));
+  if(runnable) {
+    PushReady(rq, current);
   }
+  SetCurrent(cpu, current, next);
+  rq.lock.Unlock();
+  current->on_cpu_.store(false, std::memory_order_release);
+
+  Resume(cpu, current, next);
+  RestoreContext(&next->Context());
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-  auto& level_queue = running_[current_level_];
-  Task* current_task = level_queue.front();
-  level_queue.pop_front();
+void TaskManager::Idle() {
+  CPU& cpu = CurrentCPU();
+  RunQueue& rq = run_queues_[cpu.index];
+  Task* idle = cpu.idle_task;
+  while(true) {
+    __asm__("cli");
+    rq.lock.Lock();
+    Task* next = PopReady(rq, 0);
+    if(next == nullptr) {
+      next = Steal(cpu);
+    }
+    if(next == nullptr) {
+      rq.lock.Unlock();
+      /* sti takes effect after the next instruction, so a wakeup between them isn't missed */
+      __asm__("sti\n\thlt");
+      continue;
+    }
+    SetCurrent(cpu, idle, next);
+    rq.lock.Unlock();
 
-  if(!current_sleep) {
-    level_queue.push_back(current_task);
+    Resume(cpu, idle, next);
+    SwitchContext(&next->Context(), &idle->Context(), &idle->on_cpu_);
   }
+}
 
-  if(level_queue.empty()) {
-    level_changed_ = true;
+TaskManager::RunQueue& TaskManager::LockQueueOf(Task* task) {
+  while(true) {
+    const int q = task->rq_.load(std::memory_order_acquire);
+    RunQueue& rq = run_queues_[q];
+    rq.lock.Lock();
+    if(task->rq_.load(std::memory_order_relaxed) == q) {
+      return rq;
+    }
+    rq.lock.Unlock();
   }
+}
 
-  if(level_changed_) {
-    level_changed_ = false;
-    for(int lv = kMaxLevel; lv >= 0; lv--) {
-      if(!running_[lv].empty()) {
-        current_level_ = lv;
-        break;
-      }
+void TaskManager::PushReady(RunQueue& rq, Task* task) {
+  rq.ready[task->Level()].push_back(task);
+  rq.num_ready.fetch_add(1, std::memory_order_relaxed);
+}
+
+Task* TaskManager::PopReady(RunQueue& rq, int min_level) {
+  for(int lv = kMaxLevel; lv >= min_level; lv--) {
+    if(!rq.ready[lv].empty()) {
+      Task* task = rq.ready[lv].front();
+      rq.ready[lv].pop_front();
+      rq.num_ready.fetch_sub(1, std::memory_order_relaxed);
+      return task;
     }
   }
+  return nullptr;
+}
 
-  return current_task;
+Task* TaskManager::Steal(CPU& cpu) {
+  const int num_cpus = NumCPUs();
+  for(int i = 1; i < num_cpus; i++) {
+    RunQueue& victim = run_queues_[(cpu.index + i) % num_cpus];
+    /* only tries, since the victim may be holding its own lock and trying ours */
+    if(victim.num_ready.load(std::memory_order_relaxed) == 0 || !victim.lock.TryLock()) {
+      continue;
+    }
+    Task* task = PopReady(victim, 0);
+    if(task) {
+      task->rq_.store(cpu.index, std::memory_order_release);
+    }
+    victim.lock.Unlock();
+    if(task) {
+      run_queues_[cpu.index].steals.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
 }
 
-void TaskManager::Sleep(Task* task) {
-  if(!task->Running()) return;
+bool TaskManager::IsIdle(int cpu) const {
+  const CPU& c = CPUAt(cpu);
+  return c.current_task == c.idle_task;
+}
 
-  task->SetRunning(false);
+int TaskManager::FindIdleCPU() const {
+  for(int i = 0; i < NumCPUs(); i++) {
+    if(IsIdle(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
 
-  if (task == running_[current_level_].front()) {
-    Task* current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+void TaskManager::SetCurrent(CPU& cpu, Task* current, Task* next) {
+  current->cpu_ = -1;
+  next->cpu_ = cpu.index;
+  cpu.current_task = next;
+}
+
+void TaskManager::Resume(CPU& cpu, Task* current, Task* next) {
+  /* the kernel lock goes along with the task holding it */
+  if(current->kernel_locked_) {
+    kernel_lock_.Unlock();
+  }
+  while(next->on_cpu_.load(std::memory_order_acquire)) {
+    CPURelax();
+  }
+  next->on_cpu_.store(true, std::memory_order_relaxed);
+  if(next->kernel_locked_) {
+    kernel_lock_.Lock();
+  }
+
+  /* this CPU may have stale TLB entries of the PCID if the task has run elsewhere since */
+  if(next->last_cpu_ == cpu.index) {
+    cpu.cr3_flags = cr3_no_flush;
+  } else {
+    cpu.cr3_flags = 0;
+    if(next->last_cpu_ >= 0) {
+      run_queues_[cpu.index].migrations.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  next->last_cpu_ = cpu.index;
+  StartTimeSlice(next == cpu.idle_task);
+}
+
+void TaskManager::Sleep(Task* task) {
+  InterruptGuard guard;
+  CPU& cpu = CurrentCPU();
+  RunQueue& rq = LockQueueOf(task);
+  if(task != cpu.current_task) {
+    /* a task running on another CPU stops at its next switch */
+    if(task->Running()) {
+      task->SetRunning(false);
+      if(task->cpu_ < 0) {
+        Erase(rq.ready[task->Level()], task);
+        rq.num_ready.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+    rq.lock.Unlock();
+    return;
+  }
+
+  if(task->wakeup_pending_) {
+    task->wakeup_pending_ = false;
+    rq.lock.Unlock();
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  task->SetRunning(false);
+  Task* next = PopReady(rq, 0);
+  if(next == nullptr) {
+    next = Steal(cpu);
+  }
+  if(next == nullptr) {
+    next = cpu.idle_task;
+  }
+  SetCurrent(cpu, task, next);
+  rq.lock.Unlock();
+
+  Resume(cpu, task, next);
+  SwitchContext(&next->Context(), &task->Context(), &task->on_cpu_);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){ return t->ID() == id; });
-
-  if(it == tasks_.end()) {
+  SpinLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if(task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
-  if(task->Running()) {
-    ChangeLevelRunning(task, level);
-    return;
-  }
-
-  if(level < 0) {
-    level = task->Level();
+  int idle_cpu = -1;
+  {
+    InterruptGuard guard;
+    RunQueue& rq = LockQueueOf(task);
+    if(task->Running()) {
+      if(task->cpu_ >= 0) {
+        task->wakeup_pending_ = true;
+      }
+      ChangeLevelRunning(rq, task, level);
+    } else {
+      if(level < 0) {
+        level = task->Level();
+      }
+      task->SetLevel(level);
+      task->SetRunning(true);
+
+      if(task->cpu_ >= 0) {
+        /* put to sleep by another task but not switched out yet. it just goes on */
+        task->wakeup_pending_ = true;
+      } else {
+        /* back on the CPU it last ran on, whose caches may still hold its data.
+         * if that one is busy, an idle CPU steals it, which has no tick to notice it by itself */
+        PushReady(rq, task);
+        const int q = task->rq_.load(std::memory_order_relaxed);
+        idle_cpu = IsIdle(q) ? q : FindIdleCPU();
+        if(idle_cpu == CurrentCPUIndex()) {
+          idle_cpu = -1;
+        }
+      }
+    }
+    rq.lock.Unlock();
   }
-
-  task->SetLevel(level);
-  task->SetRunning(true);
-
-  running_[level].push_back(task);
-  if(level > current_level_) {
-    level_changed_ = true;
+  if(idle_cpu >= 0) {
+    WakeCPU(idle_cpu);
   }
-  return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t){ return t->ID() == id; });
-
-  if(it == tasks_.end()) {
+  SpinLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if(task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  Wakeup(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Task& TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  /* so that the task doesn't move to another CPU in between */
+  InterruptGuard guard;
+  return *CurrentCPU().current_task;
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-      [id](const auto& t) {
-      return t->ID() == id;
-      });
-
-  if(it == tasks_.end()) return MAKE_ERROR(Error::kNoSuchTask);
-  (*it)->SendMessage(msg);
+  /* keeps the task from finishing while it is being sent to */
+  SpinLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if(task == nullptr) return MAKE_ERROR(Error::kNoSuchTask);
+  task->EnqueueMessage(msg);
+  Wakeup(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::ChangeLevelRunning(Task* task, int level) {
+void TaskManager::ChangeLevelRunning(RunQueue& rq, Task* task, int level) {
   if(level < 0 || level == task->Level()) return;
 
-  if(task != running_[current_level_].front()) {
-    Erase(running_[current_level_], task);
-    running_[level].push_back(task);
-    task->SetLevel(level);
-    if(level > current_level_) {
-      level_changed_ = true;
-    }
-
-    return;
+  /* a running task gets the new level at its next switch */
+  if(task->cpu_ < 0) {
+    Erase(rq.ready[task->Level()], task);
+    rq.ready[level].push_back(task);
   }
-
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
   task->SetLevel(level);
-  if(level >= current_level_) {
-    current_level_ = level;
-  } else {
-    current_level_ = level;
-    level_changed_ = true;
-  }
 }
 
 void TaskManager::Finish(int exit_code) {
-  Task* current_task = RotateCurrentRunQueue(true);
-  const auto task_id = current_task->ID();
-
-  auto it = std::find_if(
-      tasks_.begin(), tasks_.end(),
-      [current_task](const auto& t) { return t.get() == current_task; }
-      );
-  tasks_.erase(it);
+  __asm__("cli");
+  CPU& cpu = CurrentCPU();
+  Task* current = cpu.current_task;
+  const auto task_id = current->ID();
+  RunQueue& rq = run_queues_[cpu.index];
+
+  /* we are still running on the stack of current, so release it at the next Finish on this CPU */
+  lock_.Lock();
+  auto previous = std::move(finished_tasks_[cpu.index]);
+  finished_tasks_[cpu.index] = std::move(tasks_[task_id & (kMaxTasks - 1)]);
   finish_tasks_[task_id] = exit_code;
   if(auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
     auto waiter = it->second;
     finish_waiter_.erase(it);
     Wakeup(waiter);
   }
+  lock_.Unlock();
+
+  /* no one finds current any more, so it may be switched out without lock_ */
+  rq.lock.Lock();
+  current->SetRunning(false);
+  Task* next = PopReady(rq, 0);
+  if(next == nullptr) {
+    next = Steal(cpu);
+  }
+  if(next == nullptr) {
+    next = cpu.idle_task;
+  }
+  SetCurrent(cpu, current, next);
+  rq.lock.Unlock();
 
-  RestoreContext(&CurrentTask().Context());
+  previous.reset();
+  Resume(cpu, current, next);
+  RestoreContext(&next->Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
   int exit_code;
   Task* current_task = &CurrentTask();
   while(true) {
-    if(auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
-      exit_code = it->second;
-      finish_tasks_.erase(it);
-      break;
+    {
+      SpinLockGuard guard{lock_};
+      if(auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
+        exit_code = it->second;
+        finish_tasks_.erase(it);
+        break;
+      }
+      finish_waiter_[task_id] = current_task;
     }
-    finish_waiter_[task_id] = current_task;
     Sleep(current_task);
   }
 
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
+bool TaskManager::EnterKernel() {
+  while(true) {
+    InterruptGuard guard;
+    Task* task = CurrentCPU().current_task;
+    if(task->kernel_locked_) {
+      return false;
+    }
+    if(kernel_lock_.TryLock()) {
+      task->kernel_locked_ = true;
+      return true;
+    }
+    CPURelax();
+  }
+}
+
+void TaskManager::LeaveKernel() {
+  InterruptGuard guard;
+  Task* task = CurrentCPU().current_task;
+  if(task->kernel_locked_) {
+    task->kernel_locked_ = false;
+    kernel_lock_.Unlock();
+  }
+}
+
+bool TaskManager::HoldsKernelLock() {
+  InterruptGuard guard;
+  Task* task = CurrentCPU().current_task;
+  return task && task->kernel_locked_;
+}
+
+TaskManager::RunQueueStat TaskManager::QueueStat(int cpu) {
+  RunQueue& rq = run_queues_[cpu];
+  SpinLockGuard guard{rq.lock};
+  RunQueueStat stat;
+  for(int lv = 0; lv <= kMaxLevel; lv++) {
+    stat.ready[lv] = rq.ready[lv].size();
+  }
+  const CPU& c = CPUAt(cpu);
+  stat.current_task = c.current_task == c.idle_task ? 0 : c.current_task->ID();
+  stat.migrations = rq.migrations.load(std::memory_order_relaxed);
+  stat.steals = rq.steals.load(std::memory_order_relaxed);
+  return stat;
+}
+
 TaskManager* task_manager;
 
 __attribute__((no_caller_saved_registers))
@@ -298,12 +673,15 @@ extern "C" uint64_t GetCurrentTaskOSStackPointer() {
   return task_manager->CurrentTask().OSStackPointer();
 }
 
+extern "C" bool EnterKernel() {
+  return task_manager->EnterKernel();
+}
+
+extern "C" void LeaveKernel() {
+  task_manager->LeaveKernel();
+}
+
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(
-      Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1}
-  );
-  __asm__("sti");
+  StartTimeSlice(false);
 }
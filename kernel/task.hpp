@@ -4,11 +4,18 @@
 #include <cstddef>
 #include <vector>
 #include <deque>
+#include <list>
 #include <map>
+#include <memory>
 #include <optional>
 #include "error.hpp"
 #include "message.hpp"
 #include "fat.hpp"
+#include "memory_manager.hpp"
+#include "slab.hpp"
+#include "queue.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00 (byte)
@@ -23,23 +30,51 @@ using TaskFunc = void (uint64_t, int64_t);
 class TaskManager;
 
 struct FileMapping {
-  int fd;
+  std::shared_ptr<FileDescriptor> fd;
   uint64_t vaddr_begin, vaddr_end;
+  /* the first length bytes from vaddr_begin are the file from file_offset, and the rest is zero-filled */
+  uint64_t file_offset{0};
+  uint64_t length{0};
+  /* a shared mapping is writable, and its dirty pages are written back to the file */
+  bool shared{false};
+  /* readahead state: a fault here is sequential and maps readahead_pages from it */
+  uint64_t next_fault_addr{0};
+  size_t readahead_pages{0};
+};
+
+/* what SendMessage does when the message ring of the receiver is full */
+enum class OverflowPolicy {
+  kDrop,     /* the message is lost */
+  kCoalesce, /* merged into the newest queued message if they are alike, e.g. mouse moves or
+              * redraws of one layer, even before the ring is full. lost if it is not alike */
+  kGrow,     /* spilled into a list allocated from the slab. not for messages from interrupt handlers */
 };
 
 class Task {
   public:
     static const int kDefaultLevel = 1;
+    static const size_t kMessageRingSize = 64;
     static const size_t kDefaultStackBytes = 8 * 4096;
     Task(uint64_t id);
+    ~Task();
+    /* tasks and their message queues are allocated from slab caches */
+    static void* operator new(size_t size);
+    static void operator delete(void* p) noexcept;
     Task& InitContext(TaskFunc* f, int64_t data);
     TaskContext& Context();
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
+    /* may be called from any task or interrupt handler without disabling interrupts */
     void SendMessage(const Message& msg);
+    /* for the task itself only */
     std::optional<Message> ReceiveMessage();
+    Task& SetOverflowPolicy(OverflowPolicy policy) { overflow_policy_ = policy; return *this; }
+    uint64_t DeliveredMessages() const { return delivered_msgs_; }
+    uint64_t DroppedMessages() const { return dropped_msgs_.load(std::memory_order_relaxed); }
+    uint64_t CoalescedMessages() const { return coalesced_msgs_.load(std::memory_order_relaxed); }
+    uint64_t SpilledMessages() const { return spilled_msgs_.load(std::memory_order_relaxed); }
     std::vector<std::shared_ptr<FileDescriptor>>& Files();
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
@@ -51,31 +86,88 @@ class Task {
     std::vector<FileMapping>& FileMaps();
     int Level() const {return level_;}
     bool Running() const {return running_;}
+    uint64_t PageFaults() const { return page_faults_; }
+    void CountPageFault() { page_faults_++; }
+    /* pages of shared file mappings written back, and the write-backs which found any */
+    uint64_t WrittenBackPages() const { return written_back_pages_; }
+    uint64_t WriteBacks() const { return write_backs_; }
+    void CountWriteBack(size_t num_pages) {
+      written_back_pages_ += num_pages;
+      write_backs_ += num_pages > 0;
+    }
   private:
     uint64_t id_;
-    std::vector<uint64_t> stack_;
+    FrameID stack_frame_{kNullFrame};
     alignas(16) TaskContext context_;
     uint64_t os_stack_ptr_;
-    std::deque<Message> msgs_;
+    AtomicArrayQueue<Message, kMessageRingSize> msgs_;
+    /* kGrow only. while it is not empty, new messages go after it to keep the order */
+    std::list<Message, SlabAllocator<Message>> spilled_;
+    std::atomic<size_t> num_spilled_{0};
+    SpinLock spill_lock_;
+    OverflowPolicy overflow_policy_{OverflowPolicy::kCoalesce};
+    std::atomic<uint64_t> dropped_msgs_{0}, coalesced_msgs_{0}, spilled_msgs_{0};
+    uint64_t delivered_msgs_{0};
     unsigned int level_{kDefaultLevel};
     bool running_{false};
     std::vector<std::shared_ptr<::FileDescriptor>> files_{};
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
     uint64_t file_map_end_{0};
     std::vector<FileMapping> files_maps_{};
+    uint64_t page_faults_{0};
+    uint64_t written_back_pages_{0}, write_backs_{0};
+
+    /* the run queue of the task: of the CPU running it, holding it ready, or it last ran on.
+     * changed only with the locks of both the old and the new queue held */
+    std::atomic<int> rq_{0};
+    /* the scheduling state below is guarded by the lock of the run queue rq_ */
+    int cpu_{-1}; /* the CPU running it, or -1 */
+    int last_cpu_{-1};
+    /* woken up while running. the next Sleep returns at once, so no wakeup is lost */
+    bool wakeup_pending_{false};
+    /* true until its registers are saved after it is switched out, so no other CPU resumes it before */
+    std::atomic<bool> on_cpu_{false};
+    /* holds the kernel lock, which is let go while the task is switched out. tasks start in the kernel */
+    bool kernel_locked_{true};
 
+    void EnqueueMessage(const Message& msg);
+    void OverflowMessage(const Message& msg);
     Task& SetLevel(int level) { level_ = level; return *this; }
     Task& SetRunning(bool running) { running_ = running; return *this; }
     friend TaskManager;
 };
 
+/* Kernel code runs holding the kernel lock, so that only one CPU runs it at a time as it was
+ * written for a single CPU, while apps run in parallel. Tasks take it when they enter the kernel
+ * by a system call or a fault, and interrupt handlers guard what they share with spin locks.
+ *
+ * Each CPU has its own run queue. A task is woken up on the CPU it last ran on,
+ * and a CPU with nothing to run steals a ready task from another.
+ * lock_ is taken before run queue locks, and a CPU holding its own one only tries the others.
+ */
 class TaskManager {
   public:
     static const int kMaxLevel = 3;
 
+    /* tasks alive at a time, beyond which NewTask fails with kFull.
+     * a power of two, since the low bits of an ID index the task table */
+    static const size_t kMaxTasks = 1024;
+    static const uint64_t kMainTaskID = 1;
+
+    struct RunQueueStat {
+      std::array<size_t, kMaxLevel + 1> ready;
+      uint64_t current_task; /* 0 while idle */
+      uint64_t migrations, steals;
+    };
+
     TaskManager();
-    Task& NewTask();
+    WithError<Task*> NewTask();
+    /* called by the LAPIC timer of each CPU */
     void SwitchTask(const TaskContext& current_ctx);
+    /* makes the calling context the idle task of this CPU, which then runs tasks as well */
+    void InitializeCPU();
+    /* the body of the idle task of each CPU. never returns */
+    [[noreturn]] void Idle();
 
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
@@ -83,23 +175,76 @@ class TaskManager {
     Error Wakeup(uint64_t id, int level = -1);
     Error SendMessage(uint64_t id, const Message& msg);
     Task& CurrentTask();
+    /* calls f with the task of the ID while holding lock_, which keeps the task from finishing.
+     * f runs with interrupts disabled, so it only reads what it needs and must not sleep */
+    template <class F>
+    Error WithTask(uint64_t id, F f) {
+      SpinLockGuard guard{lock_};
+      Task* task = FindTask(id);
+      if(task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+      }
+      f(*task);
+      return MAKE_ERROR(Error::kSuccess);
+    }
 
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
+
+    /* returns false if the current task already holds the kernel lock */
+    bool EnterKernel();
+    void LeaveKernel();
+    bool HoldsKernelLock();
+
+    RunQueueStat QueueStat(int cpu);
   private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
+    struct RunQueue {
+      SpinLock lock;
+      /* tasks ready to run but not running on any CPU */
+      std::array<std::deque<Task*>, kMaxLevel + 1> ready{};
+      /* the number of ready tasks, read without the lock to find one to steal from */
+      std::atomic<size_t> num_ready{0};
+      /* tasks resumed here which last ran on another CPU, and tasks stolen by this CPU */
+      std::atomic<uint64_t> migrations{0}, steals{0};
+    };
+
+    /* guards the task table and the finish state. a task removed from the table by Finish
+     * is freed at the next Finish on its CPU, without lock_ */
+    SpinLock lock_;
+    SpinLock kernel_lock_;
+    /* the task of an ID is in the slot of its low bits. IDs whose slot is taken are skipped */
+    std::array<std::unique_ptr<Task>, kMaxTasks> tasks_{};
+    Task* main_task_{nullptr};
     uint64_t latest_id_{0};
-    std::array<std::deque<Task*>,kMaxLevel + 1> running_{};
-    int current_level_{kMaxLevel};
-    bool level_changed_{false};
+    std::array<RunQueue, kMaxCPUs> run_queues_{};
 
     std::map<uint64_t, int> finish_tasks_{};
     std::map<uint64_t, Task*> finish_waiter_{};
+    /* a finished task on each CPU, whose stack is released at the next Finish there */
+    std::array<std::unique_ptr<Task>, kMaxCPUs> finished_tasks_{};
 
-    void ChangeLevelRunning(Task* task, int level);
-    Task* RotateCurrentRunQueue(bool current_sleep);
+    /* the task of the ID, or nullptr. call with lock_ held, and use the task only until releasing it */
+    Task* FindTask(uint64_t id);
+    /* locks the run queue of the task, which may move meanwhile */
+    RunQueue& LockQueueOf(Task* task);
+    void ChangeLevelRunning(RunQueue& rq, Task* task, int level);
+    void PushReady(RunQueue& rq, Task* task);
+    /* the ready task of the highest level not lower than min_level, or nullptr */
+    Task* PopReady(RunQueue& rq, int min_level);
+    /* takes a ready task of another CPU for an idle CPU, whose run queue is locked */
+    Task* Steal(CPU& cpu);
+    /* without a lock, so the answer may be stale */
+    bool IsIdle(int cpu) const;
+    int FindIdleCPU() const;
+    void SetCurrent(CPU& cpu, Task* current, Task* next);
+    /* hands the CPU over to next after current is off the run queues. call without locks held */
+    void Resume(CPU& cpu, Task* current, Task* next);
 };
 
 extern TaskManager* task_manager;
 
 void InitializeTask();
+
+/* called by SyscallEntry, fault handlers and CallApp. see TaskManager */
+extern "C" bool EnterKernel();
+extern "C" void LeaveKernel();
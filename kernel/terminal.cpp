@@ -8,7 +8,10 @@
 #include "elf.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
+#include "slab.hpp"
+#include "boot_phase.hpp"
 #include "timer.hpp"
 #include "keyboard.hpp"
 
@@ -96,7 +99,7 @@ WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr) {
     last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
     const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096; /* calculate page by 4KB */
 
-    if(auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
+    if(auto err = SetupPageMaps(dest_addr, num_4kpages)) {
       return { last_addr, err };
     }
 
@@ -123,16 +126,69 @@ WithError<uint64_t> LoadELF(Elf64_Ehdr* ehdr) {
   return CopyLoadSegments(ehdr);
 }
 
+/* Registers the LOAD segments of the app as file mappings of the task, so that their pages are loaded
+ * on fault and .bss is zero-filled on demand. Only the ELF header and the program headers are read here.
+ * Segments sharing a page can't be told apart on fault, and are reported as kNotImplemented.
+ */
+WithError<AppLoadInfo> MapLoadSegments(fat::DirectoryEntry& file_entry, Task& task) {
+  std::shared_ptr<FileDescriptor> fd = MakeFileDescriptor<fat::FileDescriptor>(file_entry);
+
+  Elf64_Ehdr ehdr;
+  if(fd->Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) || memcmp(ehdr.e_ident, "\x7f" "ELF", 4) != 0) {
+    return { {}, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  /* check ELF file is executable */
+  if(ehdr.e_type != ET_EXEC) {
+    return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+
+  std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+  const size_t phdrs_bytes = sizeof(Elf64_Phdr) * ehdr.e_phnum;
+  if(fd->Load(phdrs.data(), phdrs_bytes, ehdr.e_phoff) != phdrs_bytes) {
+    return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+
+  std::vector<FileMapping> maps;
+  uint64_t last_addr = 0;
+  for(const auto& phdr : phdrs) {
+    if(phdr.p_type != PT_LOAD) continue;
+
+    /* check load segment address locates in the latter canonical address */
+    if(phdr.p_vaddr < 0xffff'8000'0000'0000) {
+      return { {}, MAKE_ERROR(Error::kInvalidFormat) };
+    }
+
+    const uint64_t vaddr_begin = phdr.p_vaddr & 0xffff'ffff'ffff'f000;
+    const uint64_t head = phdr.p_vaddr - vaddr_begin;
+    if(phdr.p_offset < head || (!maps.empty() && vaddr_begin < maps.back().vaddr_end)) {
+      return { {}, MAKE_ERROR(Error::kNotImplemented) };
+    }
+    const uint64_t vaddr_end = (phdr.p_vaddr + phdr.p_memsz + 4095) & 0xffff'ffff'ffff'f000;
+    maps.push_back(FileMapping{fd, vaddr_begin, vaddr_end, phdr.p_offset - head, head + phdr.p_filesz});
+    last_addr = std::max(last_addr, phdr.p_vaddr + phdr.p_memsz);
+  }
+
+  for(const auto& m : maps) {
+    task.FileMaps().push_back(m);
+  }
+  return { AppLoadInfo{last_addr, ehdr.e_entry, nullptr}, MAKE_ERROR(Error::kSuccess) };
+}
+
 WithError<PageMapEntry*> SetupPML4(Task& current_task) {
   auto pml4 = NewPageMap();
   if(pml4.error) {
     return pml4;
   }
 
-  const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+  const auto current_pml4 = CurrentPML4();
   memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
-  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+  const auto [ cr3, err ] = MakeCR3(pml4.value);
+  if(err) {
+    FreePageMap(pml4.value);
+    return { nullptr, err };
+  }
+  /* without the no-flush bit, so stale entries of a reused PCID are dropped */
   SetCR3(cr3);
   current_task.Context().cr3 = cr3;
   return pml4;
@@ -143,7 +199,8 @@ Error FreePML4(Task& current_task) {
   current_task.Context().cr3 = 0;
   ResetCR3();
 
-  return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+  ReleaseCR3(cr3);
+  return FreePageMap(CR3ToPML4(cr3));
 }
 
 void ListAllEntries(FileDescriptor& fd, uint32_t dir_cluster) {
@@ -178,8 +235,16 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
     temp_pml4 = pml4;
   }
 
-  if(auto it = app_loads->find(&file_entry); it != app_loads->end()) {
-    AppLoadInfo app_load = it->second;
+  if(lazy_app_load) {
+    auto [ app_load, err ] = MapLoadSegments(file_entry, task);
+    if(!err || err.Cause() != Error::kNotImplemented) {
+      app_load.pml4 = temp_pml4;
+      return { app_load, err };
+    }
+  }
+
+  if(auto cached = app_image_cache->Find(file_entry)) {
+    AppLoadInfo app_load = *cached;
     auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
     app_load.pml4 = temp_pml4;
     return { app_load, err };
@@ -199,14 +264,25 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
     return { {}, err_load };
   }
 
-  AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-  app_loads->insert(std::make_pair(&file_entry, app_load));
+  size_t num_pages = 0;
+  auto phdr = GetProgramHeader(elf_header);
+  for(int i = 0; i < elf_header->e_phnum; i++) {
+    if(phdr[i].p_type == PT_LOAD) {
+      num_pages += (phdr[i].p_memsz + 4095) / 4096;
+    }
+  }
 
+  AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
+  const auto temp_cr3 = task.Context().cr3;
   if(auto [ pml4, err ] = SetupPML4(task); err) {
     return { app_load, err };
   } else {
     app_load.pml4 = pml4;
   }
+  /* the template is never loaded again, so its PCID can go */
+  ReleaseCR3(temp_cr3);
+  app_image_cache->Insert(file_entry, AppLoadInfo{last_addr, elf_header->e_entry, temp_pml4},
+      num_pages);
   auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
   return { app_load, err };
 }
@@ -230,9 +306,40 @@ fat::DirectoryEntry* FindCommand(const char* command, unsigned long dir_cluster
   return FindCommand(command, apps_entry.first->FirstCluster());
 }
 
+/* replies to each kPipe message until an empty one comes. the peer of the pingpong command */
+void TaskPingPong(uint64_t task_id, int64_t data) {
+  Task& task = task_manager->CurrentTask();
+
+  while(true) {
+    __asm__("cli");
+    auto msg = task.ReceiveMessage();
+    if(!msg) {
+      task.Sleep();
+      __asm__("sti");
+      continue;
+    }
+    __asm__("sti");
+
+    if(msg->type != Message::kPipe) {
+      continue;
+    }
+    if(msg->arg.pipe.len == 0) {
+      break;
+    }
+
+    Message reply{Message::kPipe};
+    reply.src_task = task_id;
+    reply.arg.pipe.len = 1;
+    task_manager->SendMessage(msg->src_task, reply);
+  }
+
+  __asm__("cli");
+  task_manager->Finish(0);
 }
 
-std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
+}
+
+bool lazy_app_load = true;
  
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task} {
 
@@ -244,7 +351,7 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task
   } else {
     show_window_ = true;
     for(int i = 0; i < files_.size(); i++) {
-      files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+      files_[i] = MakeFileDescriptor<TerminalFileDescriptor>(*this);
     }
   }
 
@@ -403,9 +510,7 @@ void Terminal::Print(const char* s, std::optional<size_t> len) {
   Message msg = MakeLayerMessage(
       task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area
       );
-  __asm__("cli");
   task_manager->SendMessage(1, msg);
-  __asm__("sti");
 }
 
 void Terminal::ExecuteLine() {
@@ -449,7 +554,7 @@ void Terminal::ExecuteLine() {
       exit_code = 1;
       return;
     }
-    files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+    files_[1] = MakeFileDescriptor<fat::FileDescriptor>(*file);
   }
 
   std::shared_ptr<PipeDescriptor> pipe_fd;
@@ -460,8 +565,15 @@ void Terminal::ExecuteLine() {
     char* subcommand = &pipe_char[1];
     while(isspace(*subcommand)) subcommand++;
 
-    auto& subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    auto [ subtask_ptr, err ] = task_manager->NewTask();
+    if(err) {
+      PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+      last_exit_code_ = 1;
+      files_[1] = original_stdout;
+      return;
+    }
+    auto& subtask = *subtask_ptr;
+    pipe_fd = MakeFileDescriptor<PipeDescriptor>(subtask);
     auto term_desc = new TerminalDescriptor{
       subcommand, true, false,
       { pipe_fd, files_[1], files_[2] }
@@ -541,7 +653,7 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[2], " is not a directory\n", name);
         exit_code = 1;
       } else {
-        fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+        fd = MakeFileDescriptor<fat::FileDescriptor>(*file_entry);
       }
     }
 
@@ -560,7 +672,13 @@ void Terminal::ExecuteLine() {
     auto term_desc = new TerminalDescriptor{
       first_arg, true, false, files_
     };
-    task_manager->NewTask().InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc)).Wakeup();
+    if(auto [ task, err ] = task_manager->NewTask(); err) {
+      PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+      delete term_desc;
+      exit_code = 1;
+    } else {
+      task->InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc)).Wakeup();
+    }
   } else if(strcmp(command, "pwd") == 0) {
     PrintToFD(*files_[1], "%s\n", current_path_);
   } else if(strcmp(command, "cd") == 0) {
@@ -589,10 +707,205 @@ void Terminal::ExecuteLine() {
         exit_code = 1;
       }
     }
+  } else if(strcmp(command, "pingpong") == 0) {
+    /* each round trip is two task switches */
+    const int rounds = first_arg && first_arg[0] ? atoi(first_arg) : 100000;
+    auto [ peer, err ] = task_manager->NewTask();
+    if(err) {
+      PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+      exit_code = 1;
+    } else {
+      const uint64_t peer_id = peer->InitContext(TaskPingPong, 0).Wakeup().ID();
+      Message ping{Message::kPipe};
+      ping.src_task = task_.ID();
+      ping.arg.pipe.len = 1;
+
+      std::vector<Message> other_msgs; /* given back to the terminal loop after the benchmark */
+      const auto start = timer_manager->CurrentTick();
+      for(int i = 0; i < rounds; i++) {
+        task_manager->SendMessage(peer_id, ping);
+
+        while(true) {
+          __asm__("cli");
+          auto msg = task_.ReceiveMessage();
+          if(!msg) {
+            task_.Sleep();
+            __asm__("sti");
+            continue;
+          }
+          __asm__("sti");
+          if(msg->type == Message::kPipe) {
+            break;
+          }
+          other_msgs.push_back(*msg);
+        }
+      }
+      const auto elapsed = timer_manager->CurrentTick() - start;
+
+      ping.arg.pipe.len = 0;
+      __asm__("cli");
+      task_manager->SendMessage(peer_id, ping);
+      for(const auto& msg : other_msgs) {
+        task_.SendMessage(msg);
+      }
+      __asm__("sti");
+      PrintToFD(*files_[1], "%d round trips in %lu ms\n", rounds, elapsed * 1000 / kTimerFreq);
+    }
+  } else if(strcmp(command, "launchbench") == 0) {
+    /* launches an app n times with each loader. the later launches show the cost once the app is cached */
+    char* count_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if(count_arg) {
+      *count_arg = 0;
+      count_arg++;
+    }
+    const int n = count_arg ? atoi(count_arg) : 10;
+    auto file_entry = first_arg ? FindCommand(first_arg) : nullptr;
+    if(file_entry == nullptr || n < 1) {
+      PrintToFD(*files_[2], "usage: launchbench <command> [n]\n");
+      exit_code = 1;
+    } else {
+      const bool saved_mode = lazy_app_load;
+      for(const bool lazy : {false, true}) {
+        lazy_app_load = lazy;
+        const bool cached = !lazy && app_image_cache->Contains(*file_entry);
+        unsigned long first = 0, rest = 0;
+        for(int i = 0; i < n; i++) {
+          const auto start = timer_manager->CurrentTick();
+          ExecuteFile(*file_entry, first_arg, nullptr);
+          (i == 0 ? first : rest) += timer_manager->CurrentTick() - start;
+        }
+        PrintToFD(*files_[1], "%s: first %lu ms%s, then %lu us on average\n",
+            lazy ? "lazy " : "eager", first * 1000 / kTimerFreq, cached ? " (already cached)" : "",
+            n > 1 ? rest * 1000 * 1000 / kTimerFreq / (n - 1) : 0);
+      }
+      lazy_app_load = saved_mode;
+    }
+  } else if(strcmp(command, "smpbench") == 0) {
+    /* runs a command n times one after another, and then n at once, each in a terminal of its own */
+    char* count_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if(count_arg) {
+      *count_arg = 0;
+      count_arg++;
+    }
+    const int n = count_arg ? atoi(count_arg) : NumCPUs();
+    if(first_arg == nullptr || FindCommand(first_arg) == nullptr || n < 1) {
+      PrintToFD(*files_[2], "usage: smpbench <command> [n]\n");
+      exit_code = 1;
+    } else {
+      unsigned long elapsed[2];
+      for(const bool parallel : {false, true}) {
+        std::vector<uint64_t> subtask_ids;
+        const auto start = timer_manager->CurrentTick();
+        for(int i = 0; i < n; i++) {
+          auto [ task, err ] = task_manager->NewTask();
+          if(err) {
+            PrintToFD(*files_[2], "failed to create a task: %s\n", err.Name());
+            exit_code = 1;
+            break;
+          }
+          auto term_desc = new TerminalDescriptor{first_arg, true, false, files_};
+          const uint64_t id = task->InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+            .Wakeup()
+            .ID();
+          if(parallel) {
+            subtask_ids.push_back(id);
+          } else {
+            task_manager->WaitFinish(id);
+          }
+        }
+        for(const auto id : subtask_ids) {
+          task_manager->WaitFinish(id);
+        }
+        if(exit_code) {
+          break;
+        }
+        elapsed[parallel] = timer_manager->CurrentTick() - start;
+      }
+      if(exit_code == 0) {
+        PrintToFD(*files_[1], "%d runs on %d CPUs: one by one %lu ms, at once %lu ms\n",
+            n, NumCPUs(), elapsed[0] * 1000 / kTimerFreq, elapsed[1] * 1000 / kTimerFreq);
+      }
+    }
   } else if(strcmp(command, "memstat") == 0) {
     const auto p_stat = memory_manager->Stat();
+    PrintToFD(*files_[1], "Allocator : %s\n", memory_manager->Name());
     PrintToFD(*files_[1], "Phys used : %lu frames (%llu MiB)\n", p_stat.allocated_frames, p_stat.allocated_frames * kBytesPerFrame / 1024 / 1024);
     PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n", p_stat.total_frames, p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+    for(int i = 0; i < p_stat.consumer_frames.size(); i++) {
+      PrintToFD(*files_[1], "  %-11s: %lu frames\n",
+          MemoryConsumerName(static_cast<MemoryConsumer>(i)), p_stat.consumer_frames[i]);
+    }
+    PrintToFD(*files_[1], "Slab caches:\n");
+    for(auto cache = SlabCacheList(); cache; cache = cache->Next()) {
+      PrintToFD(*files_[1], "  %-8s: %4lu B, %lu/%lu in use, %lu hits, %lu misses\n",
+          cache->Name(), cache->ObjectSize(), cache->InUse(), cache->Capacity(),
+          cache->Hits(), cache->Misses());
+    }
+    PrintToFD(*files_[1], "Page cache: %lu pages, %lu hits, %lu misses, %lu evictions\n",
+        page_cache->Pages(), page_cache->Hits(), page_cache->Misses(), page_cache->Evictions());
+    PrintToFD(*files_[1], "App images: %lu images, %lu KiB pinned, %lu hits, %lu misses\n",
+        app_image_cache->Images(), app_image_cache->PinnedPages() * 4, app_image_cache->Hits(),
+        app_image_cache->Misses());
+  } else if(strcmp(command, "msgstat") == 0) {
+    /* message counters of a task, by default of the main task and this terminal */
+    const bool given = first_arg && first_arg[0];
+    const uint64_t ids[2] = {
+      given ? strtoul(first_arg, nullptr, 0) : TaskManager::kMainTaskID, task_.ID()
+    };
+    for(int i = 0; i < (given ? 1 : 2); i++) {
+      uint64_t delivered, coalesced, spilled, dropped;
+      auto err = task_manager->WithTask(ids[i], [&](Task& task) {
+        delivered = task.DeliveredMessages();
+        coalesced = task.CoalescedMessages();
+        spilled = task.SpilledMessages();
+        dropped = task.DroppedMessages();
+      });
+      if(err) {
+        PrintToFD(*files_[2], "no such task: %lu\n", ids[i]);
+        exit_code = 1;
+        continue;
+      }
+      PrintToFD(*files_[1], "task %lu: %lu delivered, %lu merged, %lu spilled, %lu dropped\n",
+          ids[i], delivered, coalesced, spilled, dropped);
+    }
+  } else if(strcmp(command, "mapstat") == 0) {
+    /* shared file mappings of a task, by default of this terminal, with their dirty pages */
+    const uint64_t id = first_arg && first_arg[0] ? strtoul(first_arg, nullptr, 0) : task_.ID();
+    size_t num_shared = 0, num_dirty = 0;
+    uint64_t written_back, write_backs;
+    /* the mappings and page tables of a task change only under the kernel lock, which this terminal holds */
+    auto err = task_manager->WithTask(id, [&](Task& task) {
+      if(const auto cr3 = task.Context().cr3; cr3 != 0) {
+        for(const FileMapping& m : task.FileMaps()) {
+          if(m.shared) {
+            num_shared++;
+            num_dirty += CountDirtyPages(CR3ToPML4(cr3), m);
+          }
+        }
+      }
+      written_back = task.WrittenBackPages();
+      write_backs = task.WriteBacks();
+    });
+    if(err) {
+      PrintToFD(*files_[2], "no such task: %lu\n", id);
+      exit_code = 1;
+    } else {
+      PrintToFD(*files_[1], "task %lu: %lu shared mappings, %lu dirty pages, %lu pages written back in %lu write-backs\n",
+          id, num_shared, num_dirty, written_back, write_backs);
+    }
+  } else if(strcmp(command, "runq") == 0) {
+    /* the run queue of each CPU: ready tasks by level from the highest, and the running task */
+    for(int i = 0; i < NumCPUs(); i++) {
+      const auto stat = task_manager->QueueStat(i);
+      char running[24] = "idle";
+      if(stat.current_task) {
+        sprintf(running, "task %lu", stat.current_task);
+      }
+      PrintToFD(*files_[1], "CPU %2d: ready %lu/%lu/%lu, %s, %lu migrations, %lu steals\n",
+          i, stat.ready[3], stat.ready[2], stat.ready[1], running, stat.migrations, stat.steals);
+    }
+  } else if(strcmp(command, "boottime") == 0) {
+    PrintBootPhases(*files_[1]);
   } else if(command[0] != 0) {
     auto file_entry = FindCommand(command);
     if(!file_entry) {
@@ -611,10 +924,11 @@ void Terminal::ExecuteLine() {
 
   if(pipe_fd) {
     pipe_fd->FinishWrite();
-    __asm__("cli");
     auto [ ec, err ] = task_manager->WaitFinish(subtask_id);
-    (*layer_task_map)[layer_id_] = task_.ID();
-    __asm__("sti");
+    {
+      SpinLockGuard guard{layer_lock};
+      (*layer_task_map)[layer_id_] = task_.ID();
+    }
     if(err) {
       Log(kWarn, "failed to wait finish: %s\n", err.Name());
     }
@@ -654,9 +968,7 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
 
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* command, char* first_arg) {
 
-  __asm__("cli");
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
 
   auto [ app_load, err ] = LoadApp(file_entry, task);
   if(err) {
@@ -695,11 +1007,21 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
 
   task.SetFileMapEnd(stack_frame_addr.value);
 
+  /* the app runs in parallel with the kernel until it calls it, and Exit returns with the lock held */
+  LeaveKernel();
   int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
       stack_frame_addr.value + stack_size - 8, &task.OSStackPointer()); /* stack alignment constraint */
 
+  /* the app can't sync its shared mappings any more, so write them back here */
+  for(const FileMapping& m : task.FileMaps()) {
+    if(m.shared) {
+      WriteBackFileMapping(m, m.vaddr_begin, m.vaddr_end);
+    }
+  }
   task.Files().clear();
   task.FileMaps().clear();
+  /* timers of an app have negative values, and no one waits for them any more */
+  timer_manager->CancelTimers(task.ID(), [](const Timer& t) { return t.Value() < 0; });
 
   if(auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
     return { ret, err };
@@ -714,9 +1036,7 @@ void Terminal::Redraw() {
       task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area
       );
 
-  __asm__("cli");
   task_manager->SendMessage(1, msg);
-  __asm__("sti");
 }
 
 void TaskTerminal(uint64_t task_id, int64_t data) {
@@ -726,15 +1046,17 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     show_window = term_desc->show_window;
   }
 
-  __asm__("cli");
   Task& task = task_manager->CurrentTask();
-  Terminal* terminal = new Terminal{task, term_desc};
-  if(show_window) {
-    layer_manager->Move(terminal->LayerID(), {100, 200});
-    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-    active_layer->Activate(terminal->LayerID());
+  Terminal* terminal;
+  {
+    SpinLockGuard guard{layer_lock};
+    terminal = new Terminal{task, term_desc};
+    if(show_window) {
+      layer_manager->Move(terminal->LayerID(), {100, 200});
+      layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+      active_layer->Activate(terminal->LayerID());
+    }
   }
-  __asm__("sti");
 
   if(term_desc && !term_desc->command_line.empty()) {
     for(int i = 0; i < term_desc->command_line.length(); i++) {
@@ -750,11 +1072,12 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     __asm__("sti");
   }
 
-  auto add_blink_timer = [task_id](unsigned long t) {
-    timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5),
-        1, task_id});
-  };
-  add_blink_timer(timer_manager->CurrentTick());
+  const int kBlinkPeriod = static_cast<int>(kTimerFreq * 0.5);
+  const auto [ blink_timer, blink_err ] = timer_manager->AddTimer(
+      Timer{timer_manager->CurrentTick() + kBlinkPeriod, 1, task_id}.Repeat(kBlinkPeriod));
+  if(blink_err) {
+    Log(kWarn, "no cursor blink timer: %s\n", blink_err.Name());
+  }
   bool window_isactive = false;
 
   while(true) {
@@ -769,15 +1092,12 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 
     switch (msg->type) {
       case Message::kTimerTimeout:
-        add_blink_timer(msg->arg.timer.timeout);
         if(show_window && window_isactive) {
           const auto area = terminal->BlinkCursor();
           Message msg = MakeLayerMessage(
               task_id, terminal->LayerID(), LayerOperation::DrawArea, area
               );
-          __asm__("cli");
           task_manager->SendMessage(1, msg);
-          __asm__("sti");
         }
         break;
       case Message::kKeyPush:
@@ -792,9 +1112,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
                 task_id, terminal->LayerID(), LayerOperation::DrawArea, area
                 );
 
-            __asm__("cli");
             task_manager->SendMessage(1, msg);
-            __asm__("sti");
           }
         }
         break;
@@ -803,6 +1121,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
         break;
       case Message::kWindowClose:
         CloseLayer(msg->arg.window_close.layer_id);
+        timer_manager->CancelTimer(blink_timer);
         __asm__("cli");
         task_manager->Finish(terminal->LastExitCode());
         break;
@@ -877,9 +1196,7 @@ size_t PipeDescriptor::Write(const void* buf, size_t len) {
     msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
     memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
     sent_bytes += msg.arg.pipe.len;
-    __asm__("cli");
     task_.SendMessage(msg);
-    __asm__("sti");
   }
   return len;
 }
@@ -926,7 +1243,5 @@ size_t PipeDescriptor::Read(void* buf, size_t len) {
 void PipeDescriptor::FinishWrite() {
   Message msg{Message::kPipe};
   msg.arg.pipe.len = 0;
-  __asm__("cli");
   task_.SendMessage(msg);
-  __asm__("sti");
 }
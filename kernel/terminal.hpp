@@ -11,13 +11,11 @@
 #include "fat.hpp"
 #include "file.hpp"
 #include "paging.hpp"
+#include "app_cache.hpp"
 
-struct AppLoadInfo {
-  uint64_t vaddr_end, entry;
-  PageMapEntry* pml4;
-};
-
-extern std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
+/* lazy: LOAD segments are file mappings paged in on fault.
+ * eager: they are copied at the first launch and kept in app_image_cache */
+extern bool lazy_app_load;
 
 struct TerminalDescriptor {
   std::string command_line;
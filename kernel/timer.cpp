@@ -1,7 +1,14 @@
 #include "timer.hpp"
+#include <cpuid.h>
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "boot_option.hpp"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "msr.hpp"
 #include "task.hpp"
+#include <algorithm>
+#include <array>
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
@@ -9,75 +16,532 @@ namespace {
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  const uint32_t kCPUIDTSCDeadline = 1u << 24; /* CPUID.01H:ECX */
+  const uint32_t kCPUIDHypervisor = 1u << 31; /* CPUID.01H:ECX */
+  const uint32_t kCPUIDInvariantTSC = 1u << 8; /* CPUID.80000007H:EDX */
+
+  bool tsc_clock = false;
+  bool tsc_deadline = false;
+  uint64_t tsc_base;
+  uint64_t tsc_freq;
+  /* ns = tsc * tsc_to_ns >> 32, and tsc = ns * ns_to_tsc >> 24 */
+  uint64_t tsc_to_ns, ns_to_tsc;
+
+  /* the PM timer extended to 64 bits */
+  SpinLock pm_lock;
+  uint64_t pm_count;
+  uint32_t last_pm;
+
+  /* the longest the bootstrap processor may sleep, limited by the PM timer and the LAPIC timer */
+  uint64_t max_sleep_ns = TimerManager::kNoDeadline;
+
+  uint64_t NanosecondsToTSC(uint64_t ns) {
+    return tsc_base + static_cast<uint64_t>((static_cast<unsigned __int128>(ns) * ns_to_tsc) >> 24);
+  }
+
+  /* decides the clock source and the mode of the LAPIC timer, before the frequencies are known */
+  void DetectClock() {
+    unsigned int eax, ebx, ecx, edx;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    const bool hypervisor = ecx & kCPUIDHypervisor;
+    const bool deadline_supported = ecx & kCPUIDTSCDeadline;
+    const bool invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & kCPUIDInvariantTSC);
+
+    /* a hypervisor keeps the rate of the TSC of a guest constant even if it doesn't say so */
+    tsc_clock = (invariant || hypervisor) && !BootOptionIs("clock", "pm");
+    /* "lapic_timer=oneshot" keeps the one-shot mode, e.g. to compare the jitter of both */
+    tsc_deadline = tsc_clock && deadline_supported && !BootOptionIs("lapic_timer", "oneshot");
+  }
+
+  struct Frequencies {
+    uint64_t tsc, lapic; /* Hz, 0 if unknown */
+  };
+
+  /* the frequencies the hypervisor or the CPU tells */
+  Frequencies FrequenciesFromCPUID() {
+    Frequencies freq{0, 0};
+    unsigned int eax, ebx, ecx, edx;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if(ecx & kCPUIDHypervisor) {
+      /* the timing leaf of VMware, which KVM and others also fill: TSC and LAPIC timer in kHz */
+      __cpuid(0x40000000, eax, ebx, ecx, edx);
+      if(eax >= 0x40000010) {
+        __cpuid(0x40000010, eax, ebx, ecx, edx);
+        freq.tsc = static_cast<uint64_t>(eax) * 1000;
+        freq.lapic = static_cast<uint64_t>(ebx) * 1000;
+      }
+    }
+
+    const unsigned int max_leaf = __get_cpuid_max(0, nullptr);
+    if(freq.tsc == 0 && max_leaf >= 0x15) {
+      /* TSC = crystal * EBX / EAX, and the LAPIC timer runs at the crystal clock */
+      __cpuid(0x15, eax, ebx, ecx, edx);
+      if(eax != 0 && ebx != 0 && ecx != 0) {
+        freq.tsc = static_cast<uint64_t>(ecx) * ebx / eax;
+        if(freq.lapic == 0) {
+          freq.lapic = ecx;
+        }
+      }
+    }
+    if(freq.tsc == 0 && max_leaf >= 0x16) {
+      /* the base frequency in MHz, which the TSC runs at when the crystal isn't enumerated */
+      __cpuid(0x16, eax, ebx, ecx, edx);
+      freq.tsc = static_cast<uint64_t>(eax & 0xffff) * 1000000;
+    }
+    return freq;
+  }
+
+  /* a reading of the PM timer and the LAPIC timer, at a TSC within tsc_error of both */
+  struct ClockReading {
+    uint64_t tsc, tsc_error;
+    uint32_t pm, lapic;
+  };
+
+  ClockReading ReadClocks() {
+    const uint64_t tsc_start = __builtin_ia32_rdtsc();
+    const uint32_t pm = acpi::ReadPMTimer();
+    const uint32_t lapic = current_count;
+    const uint64_t tsc_end = __builtin_ia32_rdtsc();
+    return {tsc_start + (tsc_end - tsc_start) / 2, (tsc_end - tsc_start + 1) / 2, pm, lapic};
+  }
+
+  const int kMinCalibrationSamples = 5;
+  const int kMaxCalibrationSamples = 15;
+  const uint32_t kCalibrationSampleCounts = acpi::kPMTimerFreq / 500; /* 2 ms */
+  const uint64_t kCalibrationMaxErrorPPM = 1000;
+
+  /* measures the TSC and the LAPIC timer against the PM timer in a few short samples, and fills in
+   * the unknown frequencies by their medians. returns the error bound of them in ppm */
+  uint64_t CalibrateFrequencies(Frequencies& freq) {
+    std::array<uint64_t, kMaxCalibrationSamples> tsc_samples, lapic_samples;
+    uint64_t error_ppm = 0;
+    int n = 0;
+
+    StartLAPICTimer();
+    while(n < kMaxCalibrationSamples) {
+      const ClockReading start = ReadClocks();
+      ClockReading end;
+      uint32_t pm_counts;
+      do {
+        end = ReadClocks();
+        pm_counts = (end.pm - start.pm) & acpi::PMTimerMask();
+      } while(pm_counts < kCalibrationSampleCounts);
+
+      const uint64_t tsc_counts = end.tsc - start.tsc;
+      tsc_samples[n] = tsc_counts * acpi::kPMTimerFreq / pm_counts;
+      lapic_samples[n] = static_cast<uint64_t>(start.lapic - end.lapic) * acpi::kPMTimerFreq / pm_counts;
+      /* the ends are known within the time to read the clocks, and the PM timer within a count */
+      error_ppm = std::max(error_ppm, (start.tsc_error + end.tsc_error) * 1000000 / tsc_counts +
+                                      1000000 / pm_counts + 1);
+      n++;
+      if(n < kMinCalibrationSamples) {
+        continue;
+      }
+
+      std::sort(tsc_samples.begin(), tsc_samples.begin() + n);
+      std::sort(lapic_samples.begin(), lapic_samples.begin() + n);
+      /* the half of the samples around the median must agree, or a sample was disturbed (e.g. by SMI) */
+      const uint64_t median = tsc_samples[n / 2];
+      const uint64_t spread = tsc_samples[n * 3 / 4] - tsc_samples[n / 4];
+      const uint64_t spread_ppm = spread * 1000000 / median;
+      if(spread_ppm <= kCalibrationMaxErrorPPM || n == kMaxCalibrationSamples) {
+        error_ppm = std::max(error_ppm, spread_ppm);
+        break;
+      }
+    }
+    StopLAPICTimer();
+
+    if(freq.tsc == 0) {
+      freq.tsc = tsc_samples[n / 2];
+    }
+    if(freq.lapic == 0) {
+      freq.lapic = lapic_samples[n / 2];
+    }
+    return error_ppm;
+  }
+
+  void StartClock() {
+    if(tsc_clock) {
+      tsc_to_ns = (kNanosecondsPerSecond << 32) / tsc_freq;
+      ns_to_tsc = (tsc_freq << 24) / kNanosecondsPerSecond;
+      tsc_base = __builtin_ia32_rdtsc();
+    } else {
+      last_pm = acpi::ReadPMTimer();
+    }
+
+    if(!tsc_deadline) {
+      max_sleep_ns = kCountMax * kNanosecondsPerSecond / lapic_timer_freq;
+    }
+    if(!tsc_clock) {
+      max_sleep_ns = std::min(max_sleep_ns,
+          static_cast<uint64_t>(acpi::PMTimerMask() / 2) * kNanosecondsPerSecond / acpi::kPMTimerFreq);
+    }
+  }
+
+  void ArmLocalTimer(CPU& cpu, uint64_t now) {
+    uint64_t deadline = cpu.slice_end;
+    if(cpu.index == 0) {
+      deadline = timer_manager->ArmDeadline(deadline, now);
+    }
+    if(tsc_deadline) {
+      /* 0 disarms it until a task comes */
+      WriteMSR(kIA32_TSC_DEADLINE, deadline == TimerManager::kNoDeadline ? 0 : NanosecondsToTSC(deadline));
+      return;
+    }
+    if(deadline == TimerManager::kNoDeadline) {
+      initial_count = 0; /* stopped until a task comes */
+      return;
+    }
+    /* rounded up, so that it doesn't fire before the deadline */
+    const uint64_t us = deadline > now ? (deadline - now + 999) / 1000 : 1;
+    initial_count = std::min(us * lapic_timer_freq / 1000000 + 1, static_cast<uint64_t>(kCountMax));
+  }
+}
+
+uint64_t NowNanoseconds() {
+  if(tsc_clock) {
+    const uint64_t delta = __builtin_ia32_rdtsc() - tsc_base;
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(delta) * tsc_to_ns) >> 32);
+  }
+
+  SpinLockGuard guard{pm_lock};
+  const uint32_t pm = acpi::ReadPMTimer();
+  pm_count += (pm - last_pm) & acpi::PMTimerMask();
+  last_pm = pm;
+  return pm_count / acpi::kPMTimerFreq * kNanosecondsPerSecond +
+    pm_count % acpi::kPMTimerFreq * kNanosecondsPerSecond / acpi::kPMTimerFreq;
+}
+
+const char* ClockSourceName() {
+  return tsc_clock ? "TSC" : "PM timer";
+}
+
+bool TSCDeadlineEnabled() {
+  return tsc_deadline;
+}
+
+uint64_t TSCFrequency() {
+  return tsc_freq;
 }
 
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
-  : timeout_{timeout}, value_{value}, task_id_{task_id} {
+  : timeout_{timeout},
+    deadline_ns_{timeout < TimerManager::kNoDeadline / kNanosecondsPerTick ?
+      timeout * kNanosecondsPerTick : TimerManager::kNoDeadline},
+    value_{value}, task_id_{task_id} {
 
   }
 
-TimerManager::TimerManager(){
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+Timer Timer::AtNanoseconds(uint64_t deadline_ns, int value, uint64_t task_id) {
+  Timer timer{0, value, task_id};
+  timer.timeout_ = deadline_ns;
+  timer.deadline_ns_ = deadline_ns;
+  timer.in_ns_ = true;
+  return timer;
+}
+
+Timer& Timer::Repeat(unsigned long period) {
+  period_ = period;
+  period_ns_ = in_ns_ ? period : period * kNanosecondsPerTick;
+  return *this;
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+TimerManager::TimerManager() : current_{NowNanoseconds() >> kGranuleShift} {
+  for(auto& level : slots_) {
+    level.fill(kNil);
+  }
+  for(uint32_t i = kMaxTimers; i-- > 0; ) {
+    nodes_[i].next = free_;
+    free_ = i;
+  }
+}
+
+unsigned long TimerManager::CurrentTick() const {
+  return NowNanoseconds() / kNanosecondsPerTick;
+}
+
+void TimerManager::Insert(uint32_t i) {
+  Node& node = nodes_[i];
+  const uint64_t granule = std::max(node.timer.DeadlineNanoseconds() >> kGranuleShift, current_);
+  int level = 0;
+  while(level < kLevels - 1 &&
+      (granule >> (kLevelBits * level)) - (current_ >> (kLevelBits * level)) >= kSlots) {
+    level++;
+  }
+  const uint64_t base = current_ >> (kLevelBits * level);
+  uint64_t pos = granule >> (kLevelBits * level);
+  if(pos - base >= kSlots) {
+    pos = base + kSlots - 1; /* beyond the top level, and put back as it turns */
+  }
+
+  node.level = level;
+  node.slot = pos & (kSlots - 1);
+  uint32_t& head = slots_[level][node.slot];
+  node.prev = kNil;
+  node.next = head;
+  if(head != kNil) {
+    nodes_[head].prev = i;
+  }
+  head = i;
+  occupied_[level] |= 1ull << node.slot;
+}
+
+void TimerManager::Unlink(uint32_t i) {
+  Node& node = nodes_[i];
+  uint32_t& head = slots_[node.level][node.slot];
+  if(node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    head = node.next;
+  }
+  if(node.next != kNil) {
+    nodes_[node.next].prev = node.prev;
+  }
+  if(head == kNil) {
+    occupied_[node.level] &= ~(1ull << node.slot);
+  }
+}
+
+void TimerManager::Release(uint32_t i) {
+  Node& node = nodes_[i];
+  node.active = false;
+  node.generation++;
+  node.next = free_;
+  free_ = i;
+}
+
+WithError<TimerID> TimerManager::AddTimer(const Timer& timer) {
+  TimerID id;
+  {
+    SpinLockGuard guard{lock_};
+    if(free_ == kNil) {
+      return { 0, MAKE_ERROR(Error::kFull) };
+    }
+    const uint32_t i = free_;
+    Node& node = nodes_[i];
+    free_ = node.next;
+    node.timer = timer;
+    node.active = true;
+    Insert(i);
+    id = static_cast<TimerID>(node.generation) << 32 | (i + 1);
+
+    if(timer.DeadlineNanoseconds() >= armed_deadline_) {
+      return { id, MAKE_ERROR(Error::kSuccess) };
+    }
+  }
+
+  /* the bootstrap processor would sleep past the timer */
+  InterruptGuard guard;
+  if(CurrentCPUIndex() == 0) {
+    ArmLocalTimer(CurrentCPU(), NowNanoseconds());
+  } else {
+    InterruptCPU(0, InterruptVector::kLAPICTimer);
+  }
+  return { id, MAKE_ERROR(Error::kSuccess) };
+}
+
+Error TimerManager::CancelTimer(TimerID id) {
+  SpinLockGuard guard{lock_};
+  const uint64_t i = (id & 0xffffffffu) - 1;
+  if(i >= kMaxTimers || !nodes_[i].active || nodes_[i].generation != id >> 32) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  Unlink(i);
+  Release(i);
+  /* the bootstrap processor may wake up for it, and then finds nothing to do */
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TimerManager::CancelTimers(uint64_t task_id, bool (*match)(const Timer&)) {
+  SpinLockGuard guard{lock_};
+  for(uint32_t i = 0; i < kMaxTimers; i++) {
+    if(nodes_[i].active && nodes_[i].timer.TaskID() == task_id && match(nodes_[i].timer)) {
+      Unlink(i);
+      Release(i);
+    }
+  }
+}
+
+void TimerManager::Tick() {
+  SpinLockGuard guard{lock_};
+  const auto now = NowNanoseconds();
+  const uint64_t target = std::max(now >> kGranuleShift, current_);
 
-  bool task_timer_timeout = false;
   while(true) {
-    const auto& t = timers_.top();
-    if(t.Timeout() > tick_) {
+    Expire(now);
+    if(current_ == target) {
       break;
     }
+    current_ = NextStop(target);
+    Cascade();
+  }
+}
+
+void TimerManager::Expire(uint64_t now) {
+  const int slot = current_ & (kSlots - 1);
+  for(uint32_t i = slots_[0][slot]; i != kNil; ) {
+    const uint32_t next = nodes_[i].next;
+    Timer& t = nodes_[i].timer;
+    if(t.DeadlineNanoseconds() <= now) {
+      Message m{Message::kTimerTimeout};
+      m.arg.timer.timeout = t.Timeout();
+      m.arg.timer.value = t.Value();
+      task_manager->SendMessage(t.TaskID(), m);
+
+      Unlink(i);
+      if(t.period_ns_ == 0) {
+        Release(i);
+      } else {
+        /* the periods missed meanwhile are skipped */
+        const uint64_t periods = (now - t.DeadlineNanoseconds()) / t.period_ns_ + 1;
+        t.deadline_ns_ += periods * t.period_ns_;
+        t.timeout_ += periods * t.period_;
+        Insert(i);
+      }
+    }
+    i = next;
+  }
+}
 
-    if(t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
+uint64_t TimerManager::NextStop(uint64_t target) const {
+  uint64_t stop = target;
+  for(int level = 0; level < kLevels; level++) {
+    const uint64_t bits = occupied_[level];
+    if(bits == 0) {
       continue;
     }
+    const int shift = kLevelBits * level;
+    const uint64_t pos = current_ >> shift;
+    const int index = pos & (kSlots - 1);
+    /* a slot after the current one in this turn, or else the first one in the next turn */
+    const uint64_t later = index == kSlots - 1 ? 0 : bits & (~0ull << (index + 1));
+    const uint64_t slot_pos = later ? pos - index + __builtin_ctzll(later)
+                                    : pos - index + kSlots + __builtin_ctzll(bits);
+    stop = std::min(stop, slot_pos << shift);
+  }
+  return stop;
+}
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    task_manager->SendMessage(t.TaskID(), m);
-
-    timers_.pop();
+void TimerManager::Cascade() {
+  /* from the top, since a timer moved down may go to a slot starting now as well */
+  for(int level = kLevels - 1; level >= 1; level--) {
+    const int shift = kLevelBits * level;
+    if(current_ & ((1ull << shift) - 1)) {
+      continue;
+    }
+    const int slot = (current_ >> shift) & (kSlots - 1);
+    uint32_t i = slots_[level][slot];
+    slots_[level][slot] = kNil;
+    occupied_[level] &= ~(1ull << slot);
+    while(i != kNil) {
+      const uint32_t next = nodes_[i].next;
+      Insert(i);
+      i = next;
+    }
   }
+}
 
-  return task_timer_timeout;
+uint64_t TimerManager::NextDeadline() const {
+  uint64_t deadline = kNoDeadline;
+  for(int level = 0; level < kLevels; level++) {
+    const uint64_t bits = occupied_[level];
+    if(bits == 0) {
+      continue;
+    }
+    /* slots are in the order of time from the current one, so the earliest timer of a level
+     * is in its first non-empty slot from there. but not on the top level, whose last slot
+     * also holds the timers beyond it */
+    const int index = (current_ >> (kLevelBits * level)) & (kSlots - 1);
+    const uint64_t rotated = index == 0 ? bits : (bits >> index) | (bits << (kSlots - index));
+    uint64_t slots = level == kLevels - 1 ? bits : 1ull << ((index + __builtin_ctzll(rotated)) & (kSlots - 1));
+    for(; slots; slots &= slots - 1) {
+      for(uint32_t i = slots_[level][__builtin_ctzll(slots)]; i != kNil; i = nodes_[i].next) {
+        deadline = std::min(deadline, nodes_[i].timer.DeadlineNanoseconds());
+      }
+    }
+  }
+  return deadline;
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+uint64_t TimerManager::ArmDeadline(uint64_t slice_end, uint64_t now) {
+  SpinLockGuard guard{lock_};
+  armed_deadline_ = std::min(slice_end, NextDeadline());
+  if(max_sleep_ns != kNoDeadline) {
+    armed_deadline_ = std::min(armed_deadline_, now + max_sleep_ns);
+  }
+  return armed_deadline_;
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
-  NotifyEndOfInterrupt();
+  CPU& cpu = CurrentCPU();
+  {
+    /* ends before SwitchTask, which resumes another task instead of returning here */
+    InterruptHandlerScope scope;
+    if(cpu.index == 0) {
+      timer_manager->Tick();
+    }
+    NotifyEndOfInterrupt();
+  }
 
-  if(task_timer_timeout) task_manager->SwitchTask(ctx_stack);
+  /* the interrupt may come early, when the bootstrap processor is told of a new timer */
+  const auto now = NowNanoseconds();
+  if(cpu.current_task == cpu.idle_task || now >= cpu.slice_end) {
+    task_manager->SwitchTask(ctx_stack);
+  } else {
+    ArmLocalTimer(cpu, now);
+  }
 }
 
 void InitializeLAPICTimer() {
-  timer_manager = new TimerManager;
-
   divide_config = 0b1011;
   lvt_timer = 0b001 << 16;
 
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  DetectClock();
+  Frequencies freq = FrequenciesFromCPUID();
+  const char* source = "CPUID";
+  uint64_t error_ppm = 0;
+  /* the LAPIC timer counts nothing with TSC-deadline */
+  if(freq.tsc == 0 || (freq.lapic == 0 && !tsc_deadline)) {
+    const uint64_t start = __builtin_ia32_rdtsc();
+    const bool from_cpuid = freq.tsc != 0 || freq.lapic != 0;
+    error_ppm = CalibrateFrequencies(freq);
+    source = from_cpuid ? "CPUID and PM timer" : "PM timer";
+    Log(kInfo, "clock: calibrated in %lu us\n",
+        (__builtin_ia32_rdtsc() - start) * 1000000 / freq.tsc);
+  }
+  tsc_freq = freq.tsc;
+  lapic_timer_freq = freq.lapic;
+  StartClock();
+  Log(kInfo, "clock: %s, %lu kHz TSC, %lu kHz LAPIC timer (%s, +-%lu ppm), %s LAPIC timer\n",
+      ClockSourceName(), tsc_freq / 1000, lapic_timer_freq / 1000, source, error_ppm,
+      tsc_deadline ? "TSC-deadline" : "one-shot");
+  timer_manager = new TimerManager;
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  StartLocalTimerInterrupt();
+}
 
+void StartLocalTimerInterrupt() {
+  if(tsc_deadline) {
+    lvt_timer = (0b10 << 17) | InterruptVector::kLAPICTimer;
+    /* so that the mode is set before the deadline is written */
+    __asm__ volatile("mfence" : : : "memory");
+    return;
+  }
   divide_config = 0b1011; 
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
-  initial_count = lapic_timer_freq / kTimerFreq; /* LAPIC count per sec / Tick per sec  */
+  lvt_timer = (0b00 << 17) | InterruptVector::kLAPICTimer; /* one-shot */
+  /* armed by StartTimeSlice when a task is resumed */
+  initial_count = 0;
+}
+
+void StartTimeSlice(bool idle) {
+  CPU& cpu = CurrentCPU();
+  const auto now = NowNanoseconds();
+  cpu.slice_end = idle ? TimerManager::kNoDeadline : now + kTimeSliceNanoseconds;
+  ArmLocalTimer(cpu, now);
 }
 
 void StartLAPICTimer() {
@@ -1,43 +1,137 @@
 #pragma once
+#include <array>
 #include <cstdint>
+#include "error.hpp"
 #include "message.hpp"
-#include <queue>
+#include "spinlock.hpp"
 #include <vector>
 #include <limits>
 
 void InitializeLAPICTimer();
+/* puts the LAPIC timer of this CPU in one-shot or TSC-deadline mode, calibrated by InitializeLAPICTimer */
+void StartLocalTimerInterrupt();
+/* Programs the LAPIC timer of this CPU for a task resumed on it. The timer fires at the end of
+ * its time slice, or never while the CPU is idle. The bootstrap processor is also woken up for the
+ * earliest timer. So there is no periodic tick, and an idle CPU sleeps until it is needed.
+ */
+void StartTimeSlice(bool idle);
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+/* Monotonic time since InitializeLAPICTimer in nanoseconds, the same on every CPU.
+ * It is counted by the TSC if its rate is constant, and by the ACPI PM timer otherwise.
+ */
+uint64_t NowNanoseconds();
+/* "TSC" or "PM timer" */
+const char* ClockSourceName();
+/* whether the LAPIC timers fire at TSC deadlines rather than after counting down */
+bool TSCDeadlineEnabled();
+/* the rate of the TSC in Hz, known after InitializeLAPICTimer even if the TSC isn't the clock */
+uint64_t TSCFrequency();
+
+const uint64_t kNanosecondsPerSecond = 1000000000;
+
+class TimerManager;
+
 class Timer {
   public:
+    /* timeout in ticks */
     Timer(unsigned long timeout, int value, uint64_t task_id);
+    /* a timer at the time of NowNanoseconds, which is also its timeout */
+    static Timer AtNanoseconds(uint64_t deadline_ns, int value, uint64_t task_id);
+    /* fires again every period, in the unit of the timeout, until cancelled */
+    Timer& Repeat(unsigned long period);
     unsigned long Timeout() const {return timeout_; }
+    uint64_t DeadlineNanoseconds() const { return deadline_ns_; }
     int Value() const {return value_; }
     uint64_t TaskID() const { return task_id_; }
   private:
     unsigned long timeout_;
+    uint64_t deadline_ns_;
     int value_;
     uint64_t task_id_;
+    bool in_ns_{false};
+    unsigned long period_{0};
+    uint64_t period_ns_{0};
+    friend TimerManager;
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-} 
+/* identifies a timer added to TimerManager. 0 is no timer */
+using TimerID = uint64_t;
+
+/* Timers are kept in nanoseconds. Ticks are only a coarser unit of NowNanoseconds for the
+ * callers of CurrentTick, and no interrupt comes at every tick.
+ *
+ * Timers are on a hierarchical timing wheel. Each level has 64 slots, a slot of a level
+ * being as long as a turn of the level below. A timer goes in the lowest level that reaches it
+ * within a turn, and is moved down a level when the wheel turns to its slot. So adding and
+ * cancelling are O(1), and they allocate nothing, since the nodes are allocated up front.
+ * The time slices of tasks are not timers but deadlines of each CPU, see StartTimeSlice.
+ */
 class TimerManager {
   public:
+    static constexpr uint64_t kNoDeadline = std::numeric_limits<uint64_t>::max();
+    /* timers alive at a time */
+    static const size_t kMaxTimers = 1024;
+
     TimerManager();
-    void AddTimer(const Timer& timer);
-    bool Tick();
-    unsigned long CurrentTick() const {return tick_;}
+    /* may be called on any CPU and in interrupt handlers. kFull if kMaxTimers timers are alive */
+    WithError<TimerID> AddTimer(const Timer& timer);
+    /* kNoSuchEntry if the timer has already fired or been cancelled */
+    Error CancelTimer(TimerID id);
+    /* cancels the timers of the task for which match returns true */
+    void CancelTimers(uint64_t task_id, bool (*match)(const Timer&));
+    /* called by the LAPIC timer of the bootstrap processor only. sends the timers due */
+    void Tick();
+    unsigned long CurrentTick() const;
+    /* the deadline for the LAPIC timer of the bootstrap processor, given that of its time slice */
+    uint64_t ArmDeadline(uint64_t slice_end, uint64_t now);
   private:
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    /* a slot of the lowest level is 2^14 ns = 16.384 us, and the top level turns in 2^50 ns = 13 days */
+    static const int kGranuleShift = 14;
+    static const int kLevelBits = 6;
+    static constexpr int kSlots = 1 << kLevelBits;
+    static const int kLevels = 6;
+    static constexpr uint32_t kNil = std::numeric_limits<uint32_t>::max();
+
+    struct Node {
+      Timer timer{0, 0, 0};
+      /* links in the slot, or next in the free list */
+      uint32_t prev{kNil}, next{kNil};
+      /* counts up on every release, so that the ID of a released timer doesn't match a new one */
+      uint32_t generation{0};
+      uint8_t level{0}, slot{0};
+      bool active{false};
+    };
+
+    std::array<Node, kMaxTimers> nodes_;
+    uint32_t free_{kNil};
+    std::array<std::array<uint32_t, kSlots>, kLevels> slots_;
+    /* a bit for each non-empty slot */
+    std::array<uint64_t, kLevels> occupied_{};
+    /* the lowest level slot in 2^kGranuleShift ns up to which the wheel has turned */
+    uint64_t current_;
+    /* when the bootstrap processor wakes up. an earlier timer makes it reprogram its LAPIC timer */
+    uint64_t armed_deadline_{0};
+    SpinLock lock_;
+
+    void Insert(uint32_t i);
+    void Unlink(uint32_t i);
+    void Release(uint32_t i);
+    /* sends the timers due in the current slot of the lowest level */
+    void Expire(uint64_t now);
+    /* the first slot after current_, not after target, where the wheel has something to do */
+    uint64_t NextStop(uint64_t target) const;
+    /* moves the timers of the slots starting at current_ down a level */
+    void Cascade();
+    uint64_t NextDeadline() const;
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
+/* no interrupt comes at every tick, so the resolution is finer than it would be with a periodic tick */
+const int kTimerFreq = 1000;
+const uint64_t kNanosecondsPerTick = kNanosecondsPerSecond / kTimerFreq;
+/* the time slice of a task */
+const uint64_t kTimeSliceNanoseconds = 20 * kNanosecondsPerTick;
@@ -1,6 +1,8 @@
 #include "usb/memory.hpp"
 
 #include <cstdint>
+#include <cstring>
+#include "memory_manager.hpp"
 
 namespace {
   template <class T>
@@ -15,10 +17,22 @@ namespace {
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+  uint8_t* memory_pool = nullptr;
+  uintptr_t alloc_ptr;
 
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
+    if (memory_pool == nullptr) {
+      auto [ pool, err ] = memory_manager->Allocate(
+          kMemoryPoolSize / kBytesPerFrame, MemoryConsumer::kUSBPool);
+      if (err) {
+        return nullptr;
+      }
+      memory_pool = reinterpret_cast<uint8_t*>(pool.Frame());
+      /* the pool used to be zeroed in .bss, and the device contexts rely on it */
+      memset(memory_pool, 0, kMemoryPoolSize);
+      alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+    }
+
     if (alignment > 0) {
       alloc_ptr = Ceil(alloc_ptr, alignment);
     }
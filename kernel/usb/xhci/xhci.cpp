@@ -2,6 +2,7 @@
 
 #include <cstring>
 #include "logger.hpp"
+#include "paging.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
 #include "usb/setupdata.hpp"
@@ -562,6 +563,10 @@ namespace usb::xhci {
     Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
     const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
     Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
+    if (auto err = ExtendIdentityMap(xhc_mmio_base + 0x10000)) {
+      Log(kError, "xHC mmio is out of the identity map: %s\n", err.Name());
+      exit(1);
+    }
 
     usb::xhci::controller = new Controller{xhc_mmio_base};
     Controller& xhc = *usb::xhci::controller;
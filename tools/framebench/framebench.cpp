@@ -0,0 +1,178 @@
+/* Allocates and frees 1M frames in mixed sizes with each frame allocator,
+ * and with the bit-by-bit first-fit scan BitmapMemoryManager used to do.
+ *
+ * The frames are a 1 GiB anonymous mapping at the same virtual address as their
+ * physical one would be, since the buddy allocator links free blocks through them.
+ */
+#include <sys/mman.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+
+/* what memory_manager.cpp uses from the rest of the kernel */
+int Log(LogLevel level, const char* format, ...) { return 0; }
+bool BootOptionIs(const char* key, const char* value) { return false; }
+Error MapKernelPages(uint64_t addr, size_t num_pages, MemoryConsumer consumer) {
+  return MAKE_ERROR(Error::kNoEnoughMemory);
+}
+Error UnmapKernelPages(uint64_t addr, size_t num_pages, MemoryConsumer consumer) {
+  return MAKE_ERROR(Error::kSuccess);
+}
+void CPURelax() {}
+bool InInterruptHandler() { return false; }
+bool TaskManager::HoldsKernelLock() { return true; }
+TaskManager* task_manager;
+extern "C" { char* program_break; char* program_break_end; }
+
+namespace {
+  const uintptr_t kPoolBase = 0x10000000;
+  const size_t kPoolBytes = 1_GiB;
+  const size_t kTotalFrames = 1000000;
+  const size_t kMinLive = 2000;
+
+  /* the allocator before word-at-a-time scanning: first fit from range_begin, a bit at a time */
+  class LinearScanMemoryManager : public MemoryManager {
+    public:
+      LinearScanMemoryManager() : alloc_map_(BitmapMemoryManager::kFrameCount / kBits) {}
+      void MarkAllocated(FrameID start_frame, size_t num_frames) override {
+        for(size_t i = 0; i < num_frames; i++) {
+          SetBit(start_frame.ID() + i, true);
+        }
+      }
+      void SetMemoryRange(FrameID range_begin, FrameID range_end) override {
+        begin_ = range_begin.ID();
+        end_ = range_end.ID();
+      }
+      const char* Name() const override { return "linear"; }
+    protected:
+      WithError<FrameID> AllocateFrames(size_t num_frames, size_t align_frames) override {
+        size_t start = begin_;
+        while(true) {
+          start = (start + align_frames - 1) & ~(align_frames - 1);
+          size_t i = 0;
+          for(; i < num_frames; i++) {
+            if(start + i >= end_) {
+              return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+            }
+            if(GetBit(start + i)) {
+              break;
+            }
+          }
+          if(i == num_frames) {
+            MarkAllocated(FrameID{start}, num_frames);
+            allocated_ += num_frames;
+            return {FrameID{start}, MAKE_ERROR(Error::kSuccess)};
+          }
+          start += i + 1;
+        }
+      }
+      Error FreeFrames(FrameID start_frame, size_t num_frames) override {
+        for(size_t i = 0; i < num_frames; i++) {
+          SetBit(start_frame.ID() + i, false);
+        }
+        allocated_ -= num_frames;
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      size_t AllocatedFrames() const override { return allocated_; }
+      size_t TotalFrames() const override { return end_ - begin_; }
+    private:
+      static const size_t kBits = 64;
+      std::vector<uint64_t> alloc_map_;
+      size_t begin_{0}, end_{0}, allocated_{0};
+
+      bool GetBit(size_t id) const { return (alloc_map_[id / kBits] >> (id % kBits)) & 1; }
+      void SetBit(size_t id, bool allocated) {
+        if(allocated) alloc_map_[id / kBits] |= uint64_t{1} << (id % kBits);
+        else alloc_map_[id / kBits] &= ~(uint64_t{1} << (id % kBits));
+      }
+  };
+
+  /* frames below the pool are allocated, as the kernel and the loader would hold them */
+  void SetupRange(MemoryManager& mm) {
+    mm.MarkAllocated(FrameID{0}, kPoolBase / kBytesPerFrame);
+    mm.SetMemoryRange(FrameID{1}, FrameID{(kPoolBase + kPoolBytes) / kBytesPerFrame});
+  }
+
+  /* returns false if two allocations overlapped or frames leaked */
+  bool Run(MemoryManager& mm) {
+    const size_t end_frame = (kPoolBase + kPoolBytes) / kBytesPerFrame;
+    const size_t allocated_before = mm.Stat().allocated_frames;
+    std::mt19937 rng{1};
+    std::vector<std::pair<size_t, size_t>> live;
+    std::vector<char> owner(end_frame, 0);
+    size_t total = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    while(total < kTotalFrames) {
+      if(live.size() < kMinLive || rng() % 2) {
+        /* mostly small allocations, with a 2 MiB page now and then */
+        const size_t n = rng() % 16 == 0 ? 512 : 1 + rng() % 8;
+        auto [ frame, err ] = mm.Allocate(n);
+        if(err) {
+          printf("%s: out of memory after %zu frames\n", mm.Name(), total);
+          return false;
+        }
+        for(size_t i = 0; i < n; i++) {
+          if(owner[frame.ID() + i]) {
+            printf("%s: frame %zu allocated twice\n", mm.Name(), frame.ID() + i);
+            return false;
+          }
+          owner[frame.ID() + i] = 1;
+        }
+        live.push_back({frame.ID(), n});
+        total += n;
+      } else {
+        const size_t k = rng() % live.size();
+        const auto [ id, n ] = live[k];
+        live[k] = live.back();
+        live.pop_back();
+        memset(&owner[id], 0, n);
+        mm.Free(FrameID{id}, n);
+      }
+    }
+    for(auto [ id, n ] : live) {
+      mm.Free(FrameID{id}, n);
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    const size_t allocated_after = mm.Stat().allocated_frames;
+    printf("%-6s: %9.1f ms for %zu frames\n", mm.Name(),
+        std::chrono::duration<double, std::milli>(end - start).count(), total);
+    if(allocated_after != allocated_before) {
+      printf("%s: %zu frames leaked\n", mm.Name(), allocated_after - allocated_before);
+      return false;
+    }
+    return true;
+  }
+}
+
+int main() {
+  void* pool = mmap(reinterpret_cast<void*>(kPoolBase), kPoolBytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+  if(pool == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  bool ok = true;
+  auto linear = new LinearScanMemoryManager;
+  SetupRange(*linear);
+  ok &= Run(*linear);
+
+  auto bitmap = new BitmapMemoryManager;
+  SetupRange(*bitmap);
+  ok &= Run(*bitmap);
+
+  /* takes over the free frames of the bitmap manager, which mustn't be used after */
+  auto buddy = new BuddyMemoryManager{*bitmap};
+  ok &= Run(*buddy);
+
+  return ok ? 0 : 1;
+}